@@ -0,0 +1,121 @@
+// Copyright 2012-2016 Mitchell mitchell.att.foicica.com. See LICENSE.
+
+// Benchmark driver for lspawn. It embeds Lua, loads the spawn module, and runs
+// a benchmark script with the functions below, which monitor spawned processes
+// using either the select() or the epoll functions.
+// Usage: lspawn_bench script.lua [select|epoll] [maxprocs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#if LUA_VERSION_NUM < 502
+#define LUA_OK 0
+#endif
+
+int luaopen_spawn(lua_State *L);
+int lspawn_pushfds(lua_State *L);
+int lspawn_readfds(lua_State *L);
+int lspawn_pushwritefds(lua_State *L);
+int lspawn_writefds(lua_State *L);
+#if __linux__
+int lspawn_dispatch(lua_State *L, int timeout);
+#endif
+
+static int use_epoll = 0;
+
+/** Returns the current time in seconds. */
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Waits up to *ms* milliseconds for spawned processes to become ready, and
+ * reads from and writes to them.
+ */
+static void pump(lua_State *L, int ms) {
+#if __linux__
+  if (use_epoll) {
+    lspawn_dispatch(L, ms);
+    return;
+  }
+#endif
+  int nfds = lspawn_pushfds(L), nwfds = lspawn_pushwritefds(L);
+  fd_set *rfds = (fd_set *)lua_touserdata(L, -2);
+  fd_set *wfds = (fd_set *)lua_touserdata(L, -1);
+  struct timeval timeout = {ms / 1000, (ms % 1000) * 1000};
+  if (select((nfds > nwfds) ? nfds : nwfds, rfds, wfds, NULL, &timeout) < 0) {
+    FD_ZERO(rfds);
+    FD_ZERO(wfds);
+  }
+  lspawn_writefds(L), lua_pop(L, 1); // wfds
+  lspawn_readfds(L), lua_pop(L, 1); // rfds
+}
+
+/** now() Lua function. */
+static int l_now(lua_State *L) {
+  return (lua_pushnumber(L, now()), 1);
+}
+
+/** pump([ms]) Lua function. */
+static int l_pump(lua_State *L) {
+  return (pump(L, luaL_optinteger(L, 1, 1000)), 0);
+}
+
+/**
+ * scan(n) Lua function.
+ * Returns the average time in microseconds of *n* non-blocking pumps, which is
+ * the per-iteration cost of an application's event loop.
+ */
+static int l_scan(lua_State *L) {
+  int n = luaL_checkinteger(L, 1);
+  double start = now();
+  for (int i = 0; i < n; i++) pump(L, 0);
+  return (lua_pushnumber(L, (now() - start) / n * 1e6), 1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s script.lua [select|epoll] [maxprocs]\n", argv[0]);
+    return 1;
+  }
+  const char *backend = (argc > 2) ? argv[2] : "select";
+  use_epoll = strcmp(backend, "epoll") == 0;
+#if !__linux__
+  if (use_epoll) return (fprintf(stderr, "epoll is not available\n"), 1);
+#endif
+  // Allow thousands of concurrent processes, each with several pipes.
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    rl.rlim_cur = rl.rlim_max, setrlimit(RLIMIT_NOFILE, &rl);
+
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  luaopen_spawn(L), lua_setglobal(L, "spawn");
+  lua_register(L, "now", l_now);
+  lua_register(L, "pump", l_pump);
+  lua_register(L, "scan", l_scan);
+  if (luaL_loadfile(L, argv[1]) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  const char *server = getenv("LSPAWN_SERVER");
+  if (server && *server && strcmp(server, "0") != 0)
+    lua_pushfstring(L, "%s+server", backend);
+  else
+    lua_pushstring(L, backend);
+  lua_pushinteger(L, (argc > 3) ? atoi(argv[3]) : 2000);
+  int status = lua_pcall(L, 2, 0, 0);
+  if (status != LUA_OK) fprintf(stderr, "%s\n", lua_tostring(L, -1));
+  lua_close(L);
+  return status != LUA_OK;
+}
@@ -0,0 +1,130 @@
+-- Copyright 2012-2016 Mitchell mitchell.att.foicica.com. See LICENSE.
+
+-- lspawn benchmarks, run by lspawn_bench.
+-- Each result is printed as a line of JSON so results from different backends
+-- and revisions can be collected and compared.
+
+local backend, maxprocs = ...
+local RUNS = 200 -- spawns per latency benchmark
+local SIZE = 64 * 1024 * 1024 -- bytes per throughput benchmark
+
+local function report(bench, value, unit, procs)
+  io.write(string.format(
+    '{"bench":"%s","backend":"%s","procs":%d,"value":%.3f,"unit":"%s"}\n',
+    bench, backend, procs or 1, value, unit))
+  io.flush()
+end
+
+local function percentile(t, p)
+  table.sort(t)
+  return t[math.max(1, math.ceil(#t * p))]
+end
+
+-- Latency from spawn() to the first byte of stdout and to the exit callback.
+local first, exit = {}, {}
+for i = 1, RUNS do
+  local start, first_byte, exited = now()
+  spawn('echo x', nil, function() first_byte = first_byte or now() end, nil,
+        function() exited = now() end)
+  while not exited do pump() end
+  first[i], exit[i] = (first_byte - start) * 1e6, (exited - start) * 1e6
+end
+report('spawn_first_byte_p50', percentile(first, 0.5), 'us')
+report('spawn_first_byte_p99', percentile(first, 0.99), 'us')
+report('spawn_exit_p50', percentile(exit, 0.5), 'us')
+report('spawn_exit_p99', percentile(exit, 0.99), 'us')
+
+-- Latency from cmd:run() of a prepared command to the exit callback.
+local cmd = spawn.command('echo x')
+for i = 1, RUNS do
+  local start, exited = now()
+  cmd:run(nil, nil, function() exited = now() end)
+  while not exited do pump() end
+  exit[i] = (exited - start) * 1e6
+end
+report('command_exit_p50', percentile(exit, 0.5), 'us')
+report('command_exit_p99', percentile(exit, 0.99), 'us')
+
+-- Stdout throughput through callbacks, in blocks and in lines.
+local zeros = string.format('head -c %d /dev/zero', SIZE)
+local lines = string.format('sh -c "yes | head -c %d"', SIZE)
+local function callback_throughput(bench, cmd, opts)
+  local n, exited, start = 0, false, now()
+  spawn(cmd, nil, function(output)
+    if type(output) == 'string' then n = n + #output return end
+    for i = 1, #output do n = n + #output[i] + 1 end
+  end, nil, function() exited = true end, opts)
+  while not exited do pump() end
+  report(bench, n / (now() - start) / 1e6, 'MB/s')
+end
+callback_throughput('stdout_cb_blocks', zeros)
+callback_throughput('stdout_cb_lines', lines, {lines = true})
+callback_throughput('stdout_cb_background_blocks', zeros, {background = true})
+callback_throughput('stdout_cb_background_lines', lines,
+  {lines = true, background = true})
+
+-- Stdout throughput of lines scanned by a filter that drops them all in C.
+local exited, start = false, now()
+local proc = spawn(lines, nil, function() end, nil,
+                   function() exited = true end, {filter = 'error:'})
+while not exited do pump() end
+report('stdout_cb_filtered', proc:stats().stdout_bytes / (now() - start) / 1e6,
+       'MB/s')
+
+-- Stdout throughput through proc:read() in each mode.
+local function read_throughput(bench, cmd, mode)
+  local n, start = 0, now()
+  local proc = spawn(cmd)
+  for output in function() return proc:read(mode) end do
+    n = n + #output + ((mode == 'l') and 1 or 0)
+  end
+  report(bench, n / (now() - start) / 1e6, 'MB/s')
+  while proc:status() == 'running' do pump(10) end
+end
+read_throughput('read_all', zeros, 'a')
+read_throughput('read_bytes', zeros, 65536)
+read_throughput('read_line', lines, 'l')
+read_throughput('read_line_keep', lines, 'L')
+
+-- Latency and stdout throughput of spawn.run(), which captures all output in C.
+for i = 1, RUNS do
+  local start = now()
+  spawn.run('echo x')
+  exit[i] = (now() - start) * 1e6
+end
+report('run_exit_p50', percentile(exit, 0.5), 'us')
+report('run_exit_p99', percentile(exit, 0.99), 'us')
+local start = now()
+report('run_all', #spawn.run(zeros) / (now() - start) / 1e6, 'MB/s')
+
+-- Throughput of many short jobs spawned all at once and through a job queue.
+local function jobs_throughput(bench, spawn, n)
+  local exited, start = 0, now()
+  for i = 1, n do
+    spawn('sh -c "i=0; while [ $i -lt 2000 ]; do i=$((i+1)); done"', nil, nil,
+          nil, function() exited = exited + 1 end)
+  end
+  while exited < n do pump() end
+  report(bench, n / (now() - start), 'jobs/s', n)
+end
+jobs_throughput('jobs_all_at_once', spawn, math.min(RUNS, maxprocs))
+local queue = spawn.queue()
+jobs_throughput('jobs_queued', function(...) return queue:spawn(...) end,
+                math.min(RUNS, maxprocs))
+
+-- Cost of one event loop iteration as the number of idle processes grows.
+local procs = {}
+for _, n in ipairs{1, 10, 100, 1000, 2000, 4000, 8000} do
+  if n > maxprocs then break end
+  while #procs < n do
+    local proc = spawn('cat')
+    if not proc then break end -- out of processes or fds
+    procs[#procs + 1] = proc
+  end
+  report('loop_iteration', scan(100), 'us', #procs)
+  if #procs < n then break end
+end
+for _, proc in ipairs(procs) do proc:kill() end
+for _, proc in ipairs(procs) do
+  while proc:status() == 'running' do pump(10) end
+end
@@ -1,22 +1,58 @@
 // Copyright 2012-2016 Mitchell mitchell.att.foicica.com. See LICENSE.
 
-#if (!GTK && __linux__)
-#define _GNU_SOURCE 1 // for execvpe from unistd.h
+#if __linux__
+#define _GNU_SOURCE 1 // for execvpe, pipe2, syscall, and waitid from unistd.h
+#elif __APPLE__
+#define _DARWIN_C_SOURCE 1 // for wait4 from sys/wait.h
 #endif
+#include <errno.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #if GTK
 #include <glib.h>
+#if !_WIN32
+#include <glib-unix.h>
+#endif
 #endif
 #if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <termios.h>
+#if __linux__
+#include <sys/syscall.h>
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434 // Linux 5.3+
+#endif
+#ifndef SYS_close_range
+#define SYS_close_range 436 // Linux 5.9+
+#endif
+#endif
 #if (!GTK || __APPLE__)
-#include <errno.h>
 #include <sys/select.h>
+#if __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 #endif
 #include <sys/wait.h>
 #include <signal.h>
+#if !GTK
+#include <sys/time.h>
+#include <time.h>
+#endif
 #else
 #include <fcntl.h>
 #include <windows.h>
@@ -44,322 +80,2984 @@
   (luaL_argcheck(l, lua_isfunction(l, n) || lua_isnoneornil(l, n), n, \
                  "function or nil expected"), \
    lua_pushvalue(l, n), luaL_ref(l, LUA_REGISTRYINDEX))
+#define READ_BUFSIZ 65536 // initial size of proc:read() buffer
+#define MAX_RBUFSIZ (1 << 20) // largest size of the buffer output is read into
 #if LUA_VERSION_NUM < 502
 #define LUA_OK 0
 #define lua_rawlen lua_objlen
 #endif
+#if LUA_VERSION_NUM >= 503
+#define l_isyieldable lua_isyieldable
+#else
+/** Returns whether or not the running coroutine can yield. */
+static int l_isyieldable(lua_State *L) {
+  int main = lua_pushthread(L);
+  return (lua_pop(L, 1), !main);
+}
+#endif
+
+/**
+ * Pushes onto the stack field *name* of the table of options at index *opts*,
+ * or `nil` if there are no options.
+ */
+static void l_getoption(lua_State *L, int opts, const char *name) {
+  if (lua_istable(L, opts))
+    lua_getfield(L, opts, name);
+  else
+    lua_pushnil(L);
+}
+
+/** A growable block of bytes. */
+typedef struct {
+  char *s;
+  size_t len, size;
+} Buf;
+
+/** A fixed-size buffer that keeps only the most recent bytes added to it. */
+typedef struct {
+  char *s;
+  size_t size, total; // capacity and number of bytes ever added
+} Ring;
+
+/**
+ * A simple pattern that lines of output must match to be passed to callbacks:
+ * text to find in each line, optionally anchored to the line's start or end.
+ */
+typedef struct {
+  char *s; // text to find, or NULL to pass all lines
+  size_t len;
+  int bol, eol; // whether or not s must start or end the line
+} Filter;
+
+/** I/O statistics for a process, or for all processes. */
+typedef struct {
+  size_t bytes[3]; // bytes read from stdout and stderr, and written to stdin
+  size_t dropped[2]; // lines of stdout and stderr dropped by filters
+  size_t reads, callbacks; // numbers of read syscalls and Lua callback calls
+  double callback_time; // seconds spent in Lua callbacks
+  double spawn_time; // seconds spent spawning
+  double first_byte; // seconds from spawn to first output, or -1 for none yet
+} Stats;
+static Stats totals; // for all processes, with times summed
+static size_t nspawned, nfirstbytes; // numbers of times summed in totals
+
+#if !_WIN32
+/** A block of input queued for writing to a process' stdin. */
+typedef struct Chunk {
+  struct Chunk *next;
+  char *data;
+  size_t len, pos; // length of data and number of bytes of it already written
+  char *map; // mapped file that data points into, or NULL
+  size_t maplen; // length of map
+} Chunk;
+#endif
 
 typedef struct {
   lua_State *L;
   int ref;
 #if !_WIN32
   int pid, fstdin, fstdout, fstderr;
+#if (!GTK || __APPLE__)
+  int fexit; // fd readable when the process has finished, or -1
+  int npids, *pids, *statuses; // pipeline stages' pids and exit statuses
+  int *pidfds; // pipeline stages' exit fds like fexit, or -1 once reaped
+  int served; // whether or not the spawn server spawned and reaps the process
+  int pty; // whether or not stdin and stdout are a pseudo-terminal
+  int background; // whether or not to read output on the background thread
+  struct Reader *reader; // background reader of stdout and stderr, or NULL
+  int reaped, status; // whether or not it finished before its reader, and how
+  struct rusage rusage; // resources used, summed over pipeline stages
+  int hasrusage; // whether or not rusage is known
+#endif
 #else
   HANDLE pid, fstdin, fstdout, fstderr;
 #endif
 #if (GTK && !__APPLE__)
+#if _WIN32
   GIOChannel *cstdout, *cstderr;
 #endif
-  int stdout_cb, stderr_cb, exit_cb;
+  guint cwatch[2]; // GLib sources monitoring stdout and stderr, or 0
+#endif
+#if !_WIN32
+  char *rbuf; // output read buffer, grown while reads fill it
+  size_t rbufsize;
+#endif
+  int hups; // hung up output fds as a bitmask (1 for stdout, 2 for stderr)
+  int paused[2]; // whether or not proc:pause() paused stdout and stderr
+  int throttled; // whether or not stdout is paused for holding too much output
+  size_t high, low; // watermarks for throttling stdout, or 0
+  char *buf; // stdout read buffer for proc:read()
+  size_t bufpos, buflen, bufsize; // start and end of unread bytes, and size
+  int eof; // whether or not stdout has been read to its end
+#if !_WIN32
+  Chunk *wqueue, *wtail; // input waiting for stdin to become writable
+  size_t wqueued; // number of bytes in wqueue
+  int wclose; // whether or not to close stdin once wqueue is written
+#if (GTK && !__APPLE__)
+  guint wwatch; // GLib source monitoring stdin while wqueue is non-empty
+#endif
+#endif
+  int stdout_cb, stderr_cb, exit_cb, drain_cb;
+  int lines; // whether or not to pass output to callbacks as tables of lines
+  Buf partial[2]; // incomplete last lines of stdout and stderr in lines mode
+  Filter filter[2]; // filters for the lines of stdout and stderr
+  Ring capture[2]; // most recent stdout and stderr output, if capturing
+  Stats stats;
+  double started; // time spawning started, in seconds
+  double timeout, grace; // seconds until the deadline, and until SIGKILL after
+  int dsignal; // signal to send at the deadline
+#if (GTK && !__APPLE__)
+  guint dwatch; // GLib source for the next deadline signal
+  guint cowatch; // GLib source for resuming co once its wait times out
+#else
+  double dkill; // time to send the next deadline signal, or 0
+  double wakeup; // time to resume co once its wait times out, or 0
+  double deadline; // earliest of dkill and wakeup, in seconds
+  int dlindex; // index in the deadline heap, or -1
+#endif
+  struct Queue *queue; // job queue the process was started from, or NULL
+  int yield; // whether or not proc:read() and proc:wait() may yield
+  lua_State *co; // coroutine waiting in proc:read() or proc:wait(), or NULL
+  int coref; // reference keeping co alive
+  char comode; // co's proc:read() mode ('l', 'L', 'a', or 'n'), or 'w' for wait
+  size_t cobytes; // number of bytes co reads in 'n' mode
 } PStream;
 
-/** p:status() Lua function. */
-static int lp_status(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  lua_pushstring(L, p->pid ? "running" : "terminated");
-  return 1;
-}
-
-/** p:wait() Lua function. */
-static int lp_wait(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  luaL_argcheck(L, p->pid, 1, "process terminated");
-  waitpid(p->pid, NULL, 0);
+/** Returns the current time in seconds, for statistics. */
+static double p_now(void) {
+#if GTK
+  return g_get_monotonic_time() / 1e6;
+#elif __linux__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#elif !_WIN32
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+#else
   return 0;
+#endif
 }
 
-/** p:read() Lua function. */
-static int lp_read(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  luaL_argcheck(L, p->pid, 1, "process terminated");
-  char *c = (char *)luaL_optstring(L, 2, "l");
-  if (*c == '*') c++; // skip optional '*' (for compatibility)
-  luaL_argcheck(L, *c == 'l' || *c == 'L' || *c == 'a' || lua_isnumber(L, 2), 2,
-                   "invalid option");
-#if (GTK && !__APPLE__)
-  char *buf = NULL;
-  size_t len = 0;
-  GError *error = NULL;
-  GIOStatus status = G_IO_STATUS_NORMAL;
-  if (!g_io_channel_get_buffered(p->cstdout))
-    g_io_channel_set_buffered(p->cstdout, TRUE); // needed for functions below
-  if (!lua_isnumber(L, 2)) {
-    if (*c == 'l' || *c == 'L') {
-      GString *s = g_string_new(NULL);
-      status = g_io_channel_read_line_string(p->cstdout, s, NULL, &error);
-      len = s->len, buf = g_string_free(s, FALSE);
-    } else if (*c == 'a') {
-      status = g_io_channel_read_to_end(p->cstdout, &buf, &len, &error);
-      if (status == G_IO_STATUS_EOF) status = G_IO_STATUS_NORMAL;
-    }
-  } else {
-    size_t bytes = (size_t)lua_tointeger(L, 2);
-    buf = malloc(bytes);
-    status = g_io_channel_read_chars(p->cstdout, buf, bytes, &len, &error);
-  }
-  if ((g_io_channel_get_buffer_condition(p->cstdout) & G_IO_IN) == 0)
-    g_io_channel_set_buffered(p->cstdout, FALSE); // needed for stdout callback
-  lua_pushlstring(L, buf, len - ((buf[len - 1] == '\n' && *c == 'l') ? 1 : 0));
-  free(buf);
-  if (status != G_IO_STATUS_NORMAL) {
-    lua_pushnil(L);
-    if (status == G_IO_STATUS_EOF) return 1;
-    lua_pushinteger(L, error->code), lua_pushstring(L, error->message);
-    return 3;
-  } else return 1;
+/** A timestamped event recorded for tracing. */
+typedef struct {
+  double time; // seconds
+  int pid; // process the event belongs to, or 0 for the event loop
+  char phase; // Chrome trace event phase: 'B' (begin), 'E' (end), 'i' (instant)
+  const char *name;
+  long arg; // number of bytes or exit status, if any
+} Event;
+static Event *events; // ring buffer of traced events, or NULL if not tracing
+static size_t nevents, ntraced; // capacity and number of events ever traced
+
+/**
+ * Traces event *name* at time *time* in phase *phase* for process *p* (or the
+ * event loop if *p* is `NULL`), with argument *arg*.
+ * When the buffer is full, the oldest event is overwritten.
+ */
+static void p_trace(PStream *p, double time, char phase, const char *name,
+                    long arg) {
+  if (!events) return;
+  Event *e = &events[ntraced++ % nevents];
+  e->time = time, e->phase = phase, e->name = name, e->arg = arg;
+#if !_WIN32
+  e->pid = p ? p->pid : 0;
 #else
-  int len = 0, n = 0;
-  if (!lua_isnumber(L, 2)) {
-    luaL_Buffer buf;
-    luaL_buffinit(L, &buf);
-    char ch;
-    while ((n = read(p->fstdout, &ch, 1)) > 0) {
-      if (ch != '\n' || *c == 'L' || *c == 'a') luaL_addchar(&buf, ch), len++;
-      if (ch == '\n' && *c != 'a') break;
-    }
-    if (n < 0 && len == 0) len = n;
-    luaL_pushresult(&buf);
-  } else {
-    size_t bytes = (size_t)lua_tointeger(L, 2);
-    char *buf = malloc(bytes);
-    if ((len = read(p->fstdout, buf, bytes)) > 0) lua_pushlstring(L, buf, len);
-    free(buf);
-  }
-  if (len <= 0) {
-    lua_pushnil(L);
-    if (len == 0) return 1;
-    lua_pushinteger(L, errno), lua_pushstring(L, strerror(errno));
-    return 3;
-  } else return 1;
+  e->pid = p ? GetProcessId(p->pid) : 0;
 #endif
 }
 
-/** p:write() Lua function. */
-static int lp_write(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  luaL_argcheck(L, p->pid, 1, "process terminated");
-  for (int i = 2; i <= lua_gettop(L); i++) {
-    size_t len;
-    const char *s = luaL_checklstring(L, i, &len);
-#if !_WIN32
-    len = write(p->fstdin, s, len); // assign result to fix compiler warning
-#else
-    DWORD len_written;
-    WriteFile(p->fstdin, s, len, &len_written, NULL);
+/**
+ * Records a read of *len* bytes (if positive) from process *p*'s stdout (or
+ * stderr if *err* is non-zero).
+ */
+static void p_countread(PStream *p, int err, long len) {
+  p->stats.reads++, totals.reads++;
+  if (len <= 0) return;
+  if (events) p_trace(p, p_now(), 'i', !err ? "stdout" : "stderr", len);
+  p->stats.bytes[err] += len, totals.bytes[err] += len;
+  if (p->stats.first_byte >= 0) return;
+  p->stats.first_byte = p_now() - p->started;
+  totals.first_byte += p->stats.first_byte, nfirstbytes++;
+}
+
+/** Records *len* bytes (if positive) written to process *p*'s stdin. */
+static void p_countwrite(PStream *p, long len) {
+  if (len <= 0) return;
+  p->stats.bytes[2] += len, totals.bytes[2] += len;
+  if (events) p_trace(p, p_now(), 'i', "stdin", len);
+}
+
+/**
+ * Ensures buffer *b* has room for *len* more bytes, returning 0 on success or
+ * -1.
+ */
+static int buf_reserve(Buf *b, size_t len) {
+  if (b->len + len <= b->size) return 0;
+  size_t size = b->size ? b->size : 256;
+  while (size < b->len + len) size *= 2;
+  char *t = realloc(b->s, size);
+  if (!t) return -1;
+  return (b->s = t, b->size = size, 0);
+}
+
+/** Appends *len* bytes *s* to buffer *b*, returning 0 on success or -1. */
+static int buf_add(Buf *b, const char *s, size_t len) {
+  if (buf_reserve(b, len) < 0) return -1;
+  return (memcpy(b->s + b->len, s, len), b->len += len, 0);
+}
+
+/** Adds *len* bytes *s* to ring buffer *r*, overwriting its oldest bytes. */
+static void ring_add(Ring *r, const char *s, size_t len) {
+  if (!r->size) return;
+  r->total += len;
+  if (len > r->size) s += len - r->size, len = r->size; // keep only the last
+  size_t pos = (r->total - len) % r->size, n = r->size - pos;
+  if (n > len) n = len;
+  memcpy(r->s + pos, s, n), memcpy(r->s, s + n, len - n);
+}
+
+/**
+ * Sends signal *sig* to process *p*, or to each of its running stages if it is
+ * a pipeline.
+ */
+static void p_kill(PStream *p, int sig) {
+#if (!GTK || __APPLE__)
+  for (int i = 0; i < p->npids; i++)
+    if (p->statuses[i] == -1) kill(p->pids[i], sig);
+  if (p->npids) return;
 #endif
+  kill(p->pid, sig);
+}
+
+/**
+ * Calls process *p*'s Lua callback *ref* with the *nargs* arguments at the top
+ * of the stack, reporting any error.
+ */
+static void p_callback(PStream *p, int ref, int nargs) {
+  double start = p_now();
+  p_trace(p, start, 'B', "callback", 0);
+  lua_rawgeti(p->L, LUA_REGISTRYINDEX, ref), lua_insert(p->L, -nargs - 1);
+  if (lua_pcall(p->L, nargs, 0, 0) != LUA_OK)
+    fprintf(stderr, "Lua: %s\n", lua_tostring(p->L, -1)), lua_pop(p->L, 1);
+  double elapsed = p_now() - start;
+  p_trace(p, start + elapsed, 'E', "callback", 0);
+  p->stats.callbacks++, p->stats.callback_time += elapsed;
+  totals.callbacks++, totals.callback_time += elapsed;
+}
+
+/**
+ * Makes room for at least *n* more bytes at the end of process *p*'s stdout
+ * read buffer, returning 0 on success or -1.
+ */
+static int p_reserve(PStream *p, size_t n) {
+  if (p->bufpos == p->buflen) p->bufpos = p->buflen = 0;
+  if (p->bufsize - p->buflen >= n) return 0;
+  if (p->bufpos > 0) {
+    memmove(p->buf, p->buf + p->bufpos, p->buflen - p->bufpos);
+    p->buflen -= p->bufpos, p->bufpos = 0;
+    if (p->bufsize - p->buflen >= n) return 0;
   }
-  return 0;
+  size_t size = p->bufsize ? p->bufsize : READ_BUFSIZ;
+  while (size - p->buflen < n) size *= 2;
+  char *buf = realloc(p->buf, size);
+  if (!buf) return -1;
+  return (p->buf = buf, p->bufsize = size, 0);
 }
 
-/** p:close() Lua function. */
-static int lp_close(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  luaL_argcheck(L, p->pid, 1, "process terminated");
-  return (close(p->fstdin), 0);
+/**
+ * Returns whether or not process *p*'s stdout read buffer can satisfy a
+ * `proc:read()` in mode *mode* ('l', 'L', 'a', or 'n' for a number of bytes)
+ * without reading more.
+ */
+static int p_canread(PStream *p, char mode) {
+  if (p->eof) return 1;
+  size_t avail = p->buflen - p->bufpos;
+  if (mode == 'n') return avail > 0;
+  return mode != 'a' && memchr(p->buf + p->bufpos, '\n', avail);
 }
 
-/** p:kill() Lua function. */
-static int lp_kill(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  if (p->pid) kill(p->pid, luaL_optinteger(L, 2, SIGKILL));
-  return 0;
+/**
+ * Returns whether or not process *p*'s stdout (or stderr if *err* is non-zero)
+ * is to be read, which is the case unless it is paused.
+ */
+static int p_reading(PStream *p, int err) {
+  return !p->paused[err] && (err || !p->throttled);
 }
 
-/** tostring(p) Lua function. */
-static int lp_tostring(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  if (p->pid)
-    lua_pushfstring(L, "process (pid=%d)", p->pid);
-  else
-    lua_pushstring(L, "process (terminated)");
-  return 1;
+static void p_watch(PStream *p, int err);
+
+/**
+ * Pauses or resumes reading process *p*'s stdout depending on how much of it is
+ * buffered, unread, for `proc:read()` compared with *p*'s watermarks, and
+ * returns whether or not it is paused.
+ * A coroutine waiting for more output than is buffered keeps it from pausing.
+ */
+static int p_throttle(PStream *p) {
+  size_t unread = p->buflen - p->bufpos;
+  int throttled = p->high && !p->eof && !(p->co && p->comode != 'w') &&
+                  (p->throttled ? unread > p->low : unread >= p->high);
+  if (throttled != p->throttled) p->throttled = throttled, p_watch(p, 0);
+  return throttled;
 }
 
-#if (GTK && !__APPLE__)
-/** __gc Lua metamethod. */
-static int lp_gc(lua_State *L) {
-  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
-  if (p->pid) {
-    // lua_close() was called, forcing GC. Disconnect listeners since GTK is
-    // still running and may try to invoke callbacks.
-    g_source_remove_by_user_data(p); // disconnect cstdout watch
-    g_source_remove_by_user_data(p); // disconnect cstderr watch
-    g_source_remove_by_user_data(p); // disconnect child watch
-  }
-  return 0;
+/**
+ * Pushes onto the stack of *L* the result of a `proc:read()` of up to *bytes*
+ * bytes in mode *mode* from process *p*'s stdout read buffer alone, like
+ * `p_canread()`, and returns the number of results.
+ */
+static int p_pushread(lua_State *L, PStream *p, char mode, size_t bytes) {
+  char *s = p->buf + p->bufpos;
+  size_t len = p->buflen - p->bufpos;
+  char *nl = (mode == 'l' || mode == 'L') ? memchr(s, '\n', len) : NULL;
+  if (nl) len = nl + 1 - s;
+  if (mode == 'n' && len > bytes) len = bytes;
+  if (len == 0) return (lua_pushnil(L), 1);
+  lua_pushlstring(L, s, len - ((nl && mode == 'l') ? 1 : 0));
+  return (p->bufpos += len, p_throttle(p), 1);
 }
 
-/** Signal that channel output is available for reading. */
-static int ch_read(GIOChannel *source, GIOCondition cond, void *data) {
-  PStream *p = (PStream *)data;
-  if (!p->pid || !(cond & G_IO_IN)) return FALSE;
-  char buf[BUFSIZ];
-  size_t len = 0;
-  do {
-    int status = g_io_channel_read_chars(source, buf, BUFSIZ, &len, NULL);
-    int r = (source == p->cstdout) ? p->stdout_cb : p->stderr_cb;
-    if (status == G_IO_STATUS_NORMAL && len > 0 && r > 0) {
-      lua_rawgeti(p->L, LUA_REGISTRYINDEX, r);
-      lua_pushlstring(p->L, buf, len);
-      if (lua_pcall(p->L, 1, 0, 0) != LUA_OK)
-        fprintf(stderr, "Lua: %s\n", lua_tostring(p->L, -1)), lua_pop(p->L, 1);
-    }
-  } while (len == BUFSIZ);
-  return p->pid && !(cond & G_IO_HUP);
+/**
+ * Makes the running coroutine *L* wait in process *p*'s `proc:read()` in mode
+ * *mode* for *bytes* bytes, or in `proc:wait()` if *mode* is 'w', until the
+ * event loop resumes it with that call's results.
+ */
+static int p_yield(lua_State *L, PStream *p, char mode, size_t bytes) {
+  p->co = L, p->comode = mode, p->cobytes = bytes;
+  p->coref = (lua_pushthread(L), luaL_ref(L, LUA_REGISTRYINDEX));
+  return lua_yield(L, 0);
 }
 
+static void p_resume(PStream *p, int nresults);
+
 /**
- * Creates a new channel that monitors a file descriptor for output.
- * @param fd File descriptor returned by `g_spawn_async_with_pipes()` or
- *   `_open_osfhandle()`.
- * @param p PStream to notify when output is available for reading.
- * @param watch Whether or not to watch for output to send to a Lua callback.
+ * Resumes the coroutine waiting in process *p*'s `proc:read()`, if any, once
+ * the read can be satisfied.
  */
-static GIOChannel *new_channel(int fd, PStream *p, int watch) {
-  GIOChannel *channel = g_io_channel_unix_new(fd);
-  g_io_channel_set_encoding(channel, NULL, NULL);
-  g_io_channel_set_buffered(channel, FALSE);
-  if (watch) {
-    g_io_add_watch(channel, G_IO_IN | G_IO_HUP, ch_read, p);
-    g_io_channel_unref(channel);
-  }
-  return channel;
+static void p_wakereader(PStream *p) {
+  if (p->co && p->comode != 'w' && p_canread(p, p->comode))
+    p_resume(p, p_pushread(p->co, p, p->comode, p->cobytes));
 }
 
-/** Signal that the child process finished. */
-static void p_exit(GPid pid, int status, void *data) {
-  PStream *p = (PStream *)data;
-  if (p->exit_cb != LUA_REFNIL) {
-    lua_rawgeti(p->L, LUA_REGISTRYINDEX, p->exit_cb);
-    lua_pushinteger(p->L, status);
-    if (lua_pcall(p->L, 1, 0, 0) != LUA_OK)
-      fprintf(stderr, "Lua: %s\n", lua_tostring(p->L, -1)), lua_pop(p->L, 1);
-  }
-#if _WIN32
-  close(p->pid);
+/**
+ * Compiles *len*-byte pattern *pattern* into filter *f*, returning 0 on success
+ * or -1.
+ * The pattern is literal text, except that a leading '^' anchors it to the
+ * start of a line and a trailing '$' anchors it to the end.
+ */
+static int f_compile(Filter *f, const char *pattern, size_t len) {
+  f->bol = len > 0 && pattern[0] == '^';
+  f->eol = len > (size_t)f->bol && pattern[len - 1] == '$';
+  pattern += f->bol, len -= f->bol + f->eol;
+  if (!(f->s = malloc(len + 1))) return -1;
+  return (memcpy(f->s, pattern, len), f->s[len] = '\0', f->len = len, 0);
+}
+
+/**
+ * Returns the first occurrence of filter *f*'s text in the *len* bytes *s*,
+ * ignoring anchors, or NULL.
+ */
+static const char *f_find(Filter *f, const char *s, size_t len) {
+  if (f->len > len) return NULL;
+  if (f->len == 0) return s;
+#if __linux__
+  return memmem(s, len, f->s, f->len);
+#else
+  // Find each occurrence of the first byte and compare the rest from there.
+  for (const char *end = s + len - f->len + 1;
+       (s = memchr(s, f->s[0], end - s)); s++)
+    if (memcmp(s + 1, f->s + 1, f->len - 1) == 0) return s;
+  return NULL;
 #endif
-  close(p->fstdin), close(p->fstdout), close(p->fstderr);
-  luaL_unref(p->L, LUA_REGISTRYINDEX, p->stdout_cb);
-  luaL_unref(p->L, LUA_REGISTRYINDEX, p->stderr_cb);
-  luaL_unref(p->L, LUA_REGISTRYINDEX, p->exit_cb);
-  luaL_unref(p->L, LUA_REGISTRYINDEX, p->ref); // allow proc to be collected
-  p->pid = 0;
-  (void)pid; // UNUSED
 }
-#elif !_WIN32
+
+/** Returns whether or not *len*-byte line *s* matches filter *f*. */
+static int f_match(Filter *f, const char *s, size_t len) {
+  if (f->len > len) return 0;
+  if (f->bol && f->eol) return len == f->len && memcmp(s, f->s, len) == 0;
+  if (f->bol || f->eol)
+    return memcmp(f->bol ? s : s + len - f->len, f->s, f->len) == 0;
+  return f_find(f, s, len) != NULL;
+}
+
 /**
- * Pushes onto the stack an fd_set of all spawned processes for use with
- * `select()` and `lspawn_readfds()` and returns the `nfds` to pass to
- * `select()`.
+ * Appends *len*-byte line *s* of output from process *p*'s stdout (or stderr if
+ * *err* is non-zero) to the table at the top of the stack, unless the stream's
+ * filter drops it.
+ * Outside of lines mode, the line's newline (if *nl* is non-zero) is kept; it
+ * follows *s*.
  */
-int lspawn_pushfds(lua_State *L) {
-  int nfds = 1;
-  fd_set *fds = (fd_set *)lua_newuserdata(L, sizeof(fd_set));
-  FD_ZERO(fds);
-  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
-  lua_pushnil(L);
-  while (lua_next(L, -2)) {
-    PStream *p = (PStream *)lua_touserdata(L, -2);
-    FD_SET(p->fstdout, fds);
-    FD_SET(p->fstderr, fds);
-    if (p->fstdout >= nfds) nfds = p->fstdout + 1;
-    if (p->fstderr >= nfds) nfds = p->fstderr + 1;
-    lua_pop(L, 1); // value
+static void p_addline(PStream *p, int err, const char *s, size_t len, int nl) {
+  Filter *f = &p->filter[err];
+  if (f->s && !f_match(f, s, len)) {
+    p->stats.dropped[err]++, totals.dropped[err]++;
+    return;
   }
-  lua_pop(L, 1); // spawn_procs
-  return nfds;
+  lua_pushlstring(p->L, s, len + (!p->lines && nl));
+  lua_rawseti(p->L, -2, lua_rawlen(p->L, -2) + 1);
 }
 
-/** Signal that a fd has output to read. */
-static void fd_read(int fd, PStream *p) {
-  char buf[BUFSIZ];
-  ssize_t len;
-  do {
-    len = read(fd, buf, BUFSIZ);
-    int r = (fd == p->fstdout) ? p->stdout_cb : p->stderr_cb;
-    if (len > 0 && r > 0) {
-      lua_rawgeti(p->L, LUA_REGISTRYINDEX, r);
-      lua_pushlstring(p->L, buf, len);
-      if (lua_pcall(p->L, 1, 0, 0) != LUA_OK)
-        fprintf(stderr, "Lua: %s\n", lua_tostring(p->L, -1)), lua_pop(p->L, 1);
+/**
+ * Passes *len* bytes of output *s* from process *p*'s stdout (or stderr if
+ * *err* is non-zero) to the appropriate Lua callback, capturing it first if
+ * requested.
+ * In lines mode, or if the stream is filtered, complete lines are instead
+ * appended to the table at the top of the stack (pushed by the caller), and any
+ * incomplete last line is kept until the rest of it arrives.
+ */
+static void p_output(PStream *p, int err, const char *s, size_t len) {
+  ring_add(&p->capture[err], s, len);
+  int r = !err ? p->stdout_cb : p->stderr_cb;
+  if (r <= 0) return;
+  if (!p->lines && !p->filter[err].s) {
+    lua_pushlstring(p->L, s, len), p_callback(p, r, 1);
+    return;
+  }
+  Buf *partial = &p->partial[err];
+  Filter *f = &p->filter[err];
+  int skip = f->s && !f->bol && !f->eol; // whether lines may be skipped
+  const char *match = NULL; // next occurrence of the filter's text, if known
+  for (const char *nl, *end = s + len; s < end; s = nl + 1) {
+    if (skip && partial->len == 0) {
+      // Search the rest of the output for the filter's text at once, and drop
+      // the lines before the one it is in without looking at them further.
+      if (!match || match < s)
+        if (!(match = f_find(f, s, end - s))) match = end;
+      size_t dropped = 0;
+      for (; (nl = memchr(s, '\n', match - s)); s = nl + 1) dropped++;
+      p->stats.dropped[err] += dropped, totals.dropped[err] += dropped;
+    }
+    if (!(nl = memchr(s, '\n', end - s))) {
+      buf_add(partial, s, end - s);
+      break;
     }
-  } while (len == BUFSIZ);
+    if (partial->len > 0) {
+      buf_add(partial, s, nl + 1 - s); // keep the newline after the line
+      p_addline(p, err, partial->s, partial->len - 1, 1), partial->len = 0;
+    } else p_addline(p, err, s, nl - s, 1);
+  }
+}
+
+/**
+ * Begins a batch of output from process *p*'s stdout (or stderr if *err* is
+ * non-zero) and returns whether or not `p_endoutput()` must end it.
+ * In lines mode, or if the stream is filtered, this pushes the table that
+ * collects the batch's lines.
+ */
+static int p_beginoutput(PStream *p, int err) {
+  if (!p->lines && !p->filter[err].s) return 0;
+  if ((!err ? p->stdout_cb : p->stderr_cb) <= 0) return 0;
+  return (lua_newtable(p->L), 1);
+}
+
+/**
+ * Ends a batch of output begun by `p_beginoutput()`, passing the batch's lines
+ * to the appropriate Lua callback in a single call, either as a table or,
+ * outside of lines mode, joined back into a single block.
+ * If *eof* is non-zero, any incomplete last line is passed too.
+ */
+static void p_endoutput(PStream *p, int err, int eof) {
+  lua_State *L = p->L;
+  Buf *partial = &p->partial[err];
+  if (eof && partial->len > 0)
+    p_addline(p, err, partial->s, partial->len, 0), partial->len = 0;
+  int n = lua_rawlen(L, -1);
+  if (n == 0) {
+    lua_pop(L, 1); // empty table
+    return;
+  }
+  if (!p->lines) {
+    int t = lua_gettop(L);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (int i = 1; i <= n; i++) lua_rawgeti(L, t, i), luaL_addvalue(&b);
+    luaL_pushresult(&b), lua_replace(L, t);
+  }
+  p_callback(p, !err ? p->stdout_cb : p->stderr_cb, 1);
+}
+
+#if !_WIN32
+extern char **environ;
+#if (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_CHDIR 1 // posix_spawn_file_actions_addchdir_np()
+#endif
+
+/**
+ * Returns close-on-exec fd *fd*, moved to an fd greater than 2 if necessary so
+ * it cannot clash with a child's stdin, stdout, or stderr, or -1 with errno set
+ * on failure (closing *fd*). If *fd* is -1, returns it with errno unchanged.
+ */
+static int p_movefd(int fd) {
+  if (fd < 0 || fd > 2) return fd;
+  int moved = fcntl(fd, F_DUPFD, 3), error = errno;
+  if (moved >= 0) fcntl(moved, F_SETFD, FD_CLOEXEC);
+  return (close(fd), errno = error, moved);
+}
+
+/**
+ * Creates a close-on-exec pipe whose fds are both greater than 2, so neither can
+ * clash with a child's stdin, stdout, or stderr. Returns 0 on success, or -1
+ * with *fds* set to -1 and errno set on failure.
+ * Since the pipe is close-on-exec, other children spawned while this one runs
+ * do not inherit it and cannot delay its EOF.
+ */
+static int p_pipe(int fds[2]) {
+#if __linux__
+  if (pipe2(fds, O_CLOEXEC) < 0) return (fds[0] = fds[1] = -1);
+#else
+  if (pipe(fds) < 0) return (fds[0] = fds[1] = -1);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC), fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+  for (int i = 0; i < 2; i++) fds[i] = p_movefd(fds[i]);
+  if (fds[0] >= 0 && fds[1] >= 0) return 0;
+  int error = errno;
+  if (fds[0] >= 0) close(fds[0]);
+  if (fds[1] >= 0) close(fds[1]);
+  return (errno = error, fds[0] = fds[1] = -1);
+}
+
+/**
+ * Opens a pseudo-terminal for a child's stdin and stdout, and returns 0 on
+ * success, or -1 with all fds set to -1 and errno set on failure.
+ * Like with pipes, *in* and *out* receive the child's and the parent's ends of
+ * stdin and stdout, which are duplicates of the terminal's slave and master,
+ * respectively. All fds are close-on-exec and greater than 2.
+ * @param cols Number of columns in the terminal's window.
+ * @param rows Number of rows in the terminal's window.
+ * @param raw Whether or not to disable echo, line editing, special characters,
+ *   and output processing like translating "\n" to "\r\n".
+ */
+static int p_openpty(int in[2], int out[2], int cols, int rows, int raw) {
+  int fds[4] = {-1, -1, -1, -1}; // master, slave, and duplicates of them
+  const char *name;
+  if ((fds[0] = posix_openpt(O_RDWR | O_NOCTTY)) >= 0)
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC), fds[0] = p_movefd(fds[0]);
+  if (fds[0] >= 0 && grantpt(fds[0]) == 0 && unlockpt(fds[0]) == 0 &&
+      (name = ptsname(fds[0])))
+    fds[1] = p_movefd(open(name, O_RDWR | O_NOCTTY | O_CLOEXEC));
+  for (int i = 2; i < 4 && fds[i - 1] >= 0; i++)
+    if ((fds[i] = fcntl(fds[3 - i], F_DUPFD, 3)) >= 0)
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  if (fds[3] < 0) {
+    int error = errno;
+    for (int i = 0; i < 4; i++)
+      if (fds[i] >= 0) close(fds[i]);
+    return (errno = error, in[0] = in[1] = out[0] = out[1] = -1);
+  }
+  struct termios t;
+  if (raw && tcgetattr(fds[1], &t) == 0) {
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL |
+                   IXON);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(CSIZE | PARENB), t.c_cflag |= CS8;
+    t.c_cc[VMIN] = 1, t.c_cc[VTIME] = 0;
+    tcsetattr(fds[1], TCSANOW, &t);
+  }
+#ifdef TIOCSWINSZ
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws)), ws.ws_col = cols, ws.ws_row = rows;
+  ioctl(fds[1], TIOCSWINSZ, &ws);
+#endif
+  in[0] = fds[2], in[1] = fds[3], out[0] = fds[0], out[1] = fds[1];
+  return 0;
+}
+
+/**
+ * Spawns program *file* with fds *fds* as its stdin, stdout, and stderr, and
+ * returns its pid, or -1 with errno set on failure.
+ * Failure to change to directory *cwd* or to execute the program is reported
+ * here instead of from within the child process.
+ * @param file The program to execute. `PATH` is searched for it unless it
+ *   contains a '/'. This is normally `argv[0]`.
+ * @param argv NULL-terminated list of program name and arguments.
+ * @param cwd Optional working directory for the child. May be `NULL`.
+ * @param envp Optional NULL-terminated environment for the child. If `NULL`,
+ *   the child inherits the parent's environment.
+ * @param fds Fds for the child's stdin, stdout, and stderr. Each must be greater
+ *   than 2.
+ */
+static pid_t p_spawn(const char *file, char **argv, const char *cwd,
+                     char **envp, int fds[3]) {
+  pid_t pid = -1;
+#if !HAVE_SPAWN_CHDIR
+  if (!cwd) {
+#endif
+  // posix_spawn() avoids copying the parent's page tables like fork() does.
+  posix_spawn_file_actions_t actions;
+  int error = posix_spawn_file_actions_init(&actions);
+  for (int i = 0; i < 3 && !error; i++)
+    error = posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+#if HAVE_SPAWN_CHDIR
+  if (cwd && !error)
+    error = posix_spawn_file_actions_addchdir_np(&actions, cwd);
+#endif
+  if (!error)
+    error = posix_spawnp(&pid, file, &actions, NULL, argv,
+                         envp ? envp : environ);
+  posix_spawn_file_actions_destroy(&actions);
+  return error ? (errno = error, -1) : pid;
+#if !HAVE_SPAWN_CHDIR
+  }
+  // Fall back on fork() and report any child errors through a pipe.
+  int perr[2], error = 0;
+  if (p_pipe(perr) < 0) return -1;
+  if ((pid = fork()) == 0) {
+    for (int i = 0; i < 3; i++) dup2(fds[i], i);
+    if (chdir(cwd) == 0) {
+#if __linux__
+      execvpe(file, argv, envp ? envp : environ); // does not return
+#else
+      if (envp) environ = envp;
+      execvp(file, argv); // does not return on success
+#endif
+    }
+    error = errno;
+    write(perr[1], &error, sizeof(int)), _exit(127);
+  }
+  close(perr[1]);
+  if (pid > 0) {
+    ssize_t n;
+    while ((n = read(perr[0], &error, sizeof(int))) < 0 && errno == EINTR) ;
+    if (n == sizeof(int)) waitpid(pid, NULL, 0), pid = -1; // exec failed
+  } else error = errno;
+  close(perr[0]);
+  return (errno = error, pid);
+#endif
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
+#endif
+static int server = -1; // socket connected to the spawn server, or -1
+static int sv_chld = -1; // spawn server's SIGCHLD self-pipe
+
+/**
+ * A request for the spawn server to spawn a process. It is sent along with the
+ * child's stdin, stdout, and stderr fds, plus the write end of a pipe the
+ * server writes the child's exit status to, and is followed by *len* bytes of
+ * NUL-terminated argv strings, envp strings, cwd ("" for none), program file
+ * to execute, and the `PATH` to search for it.
+ */
+typedef struct {
+  int argc, envc;
+  int path; // whether or not PATH is set, since an empty PATH means "."
+  size_t len;
+} Request;
+
+/** A spawned process' exit status and resource usage, from the spawn server. */
+typedef struct {
+  int status;
+  struct rusage rusage;
+} Exit;
+
+/**
+ * Sends (if *out* is non-zero) or receives all *len* bytes of *buf* over socket
+ * *sock*, along with fds *fds* if *nfds* is non-zero, and returns 0 on success
+ * or -1 on failure or EOF.
+ */
+static int sv_io(int sock, void *buf, size_t len, int *fds, int nfds, int out) {
+  union {
+    char buf[CMSG_SPACE(4 * sizeof(int))];
+    struct cmsghdr align; // control data must be aligned for its header
+  } control;
+  while (len > 0) {
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {NULL, 0, &iov, 1, NULL, 0, 0};
+    if (nfds) msg.msg_control = control.buf, msg.msg_controllen = CMSG_SPACE(
+      nfds * sizeof(int));
+    struct cmsghdr *cmsg = nfds ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && out) {
+      cmsg->cmsg_level = SOL_SOCKET, cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    ssize_t n = out ? sendmsg(sock, &msg, MSG_NOSIGNAL) : recvmsg(sock, &msg, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    if (nfds && !out) {
+      cmsg = CMSG_FIRSTHDR(&msg);
+      if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+          cmsg->cmsg_len != CMSG_LEN(nfds * sizeof(int)))
+        return -1;
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+      for (int i = 0; i < nfds; i++) fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    buf = (char *)buf + n, len -= n, nfds = 0; // fds accompany the first byte
+  }
+  return 0;
+}
+
+/** Signal handler that wakes up the spawn server when a child finishes. */
+static void sv_sigchld(int sig) {
+  int error = errno;
+  write(sv_chld, "", 1);
+  errno = error;
+}
+
+/** Signal handler that ignores a signal without its children ignoring it. */
+static void sv_ignore(int sig) {}
+
+/** Closes all fds from *fd* on. */
+static void sv_closefrom(int fd) {
+#if __linux__
+  if (syscall(SYS_close_range, fd, ~0U, 0) == 0) return;
+#endif
+  // Without close_range(), close each fd that could be open. (closefrom() is
+  // not declared under _XOPEN_SOURCE.)
+  for (int max = sysconf(_SC_OPEN_MAX); fd < max; fd++) close(fd);
+}
+
+/**
+ * Runs the spawn server, which spawns processes for requests received over
+ * socket *sock* and reports their exit statuses, until the socket is closed.
+ */
+static void sv_main(int sock) {
+  // Do not keep the parent's other fds open, and do not die when the terminal
+  // interrupts the parent.
+  if (sock != 3) dup2(sock, 3), close(sock), sock = 3;
+  fcntl(sock, F_SETFD, FD_CLOEXEC), sv_closefrom(4);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa)), sigemptyset(&sa.sa_mask);
+  sa.sa_handler = sv_ignore;
+  sigaction(SIGINT, &sa, NULL), sigaction(SIGQUIT, &sa, NULL);
+  sigaction(SIGPIPE, &sa, NULL);
+  int chld[2];
+  if (p_pipe(chld) < 0) _exit(1);
+  fcntl(chld[0], F_SETFL, O_NONBLOCK), fcntl(chld[1], F_SETFL, O_NONBLOCK);
+  sv_chld = chld[1], sa.sa_handler = sv_sigchld, sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, NULL);
+  struct { pid_t pid; int fd; } *kids = NULL; // running children's status pipes
+  int nkids = 0;
+  for (;;) {
+    struct pollfd pfds[2] = {{sock, POLLIN, 0}, {chld[0], POLLIN, 0}};
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (pfds[1].revents) {
+      char c;
+      while (read(chld[0], &c, 1) > 0) ;
+      Exit e;
+      for (pid_t pid; (pid = wait4(-1, &e.status, WNOHANG, &e.rusage)) > 0;)
+        for (int i = 0; i < nkids; i++) {
+          if (kids[i].pid != pid) continue;
+          write(kids[i].fd, &e, sizeof(Exit)), close(kids[i].fd);
+          kids[i] = kids[--nkids];
+          break;
+        }
+    }
+    if (!pfds[0].revents) continue;
+    Request r;
+    int fds[4];
+    if (sv_io(sock, &r, sizeof(Request), fds, 4, 0) < 0) break; // parent exited
+    char *s = malloc(r.len), *strs = s;
+    char **argv = malloc((r.argc + r.envc + 2) * sizeof(char *));
+    if (!s || !argv || sv_io(sock, s, r.len, NULL, 0, 0) < 0) break;
+    char **envp = argv + r.argc + 1;
+    for (int i = 0; i < r.argc; i++) argv[i] = s, s += strlen(s) + 1;
+    for (int i = 0; i < r.envc; i++) envp[i] = s, s += strlen(s) + 1;
+    argv[r.argc] = envp[r.envc] = NULL;
+    char *cwd = s, *file = s + strlen(s) + 1, *path = file + strlen(file) + 1;
+    // Search the parent's current PATH, which posix_spawnp() takes from this
+    // process' environment.
+    if (r.path) setenv("PATH", path, 1); else unsetenv("PATH");
+    int reply[2]; // pid and errno
+    reply[0] = p_spawn(file, argv, *cwd ? cwd : NULL, envp, fds);
+    reply[1] = errno;
+    free(strs), free(argv);
+    close(fds[0]), close(fds[1]), close(fds[2]);
+    void *t = (reply[0] > 0) ? realloc(kids, (nkids + 1) * sizeof(*kids)) : NULL;
+    if (t) kids = t, kids[nkids].pid = reply[0], kids[nkids++].fd = fds[3];
+    else close(fds[3]); // on failure, the status pipe's EOF is the only report
+    if (sv_io(sock, reply, sizeof(reply), NULL, 0, 1) < 0) break;
+  }
+  _exit(0);
+}
+
+/**
+ * Starts the spawn server, which is forked from this process once while it is
+ * still small, so later spawns need not copy this process' page tables.
+ */
+static void sv_start(void) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return;
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC), fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(int));
+  setsockopt(sv[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(int));
+#endif
+  pid_t pid = fork();
+  if (pid == 0) close(sv[0]), sv_main(sv[1]); // does not return
+  close(sv[1]);
+  if (pid > 0) server = sv[0]; else close(sv[0]);
+}
+
+/**
+ * Spawns a process like `p_spawn()`, but through the spawn server if it is
+ * running, in which case *fexit* is set to a non-blocking fd that becomes
+ * readable with the process' exit status once it finishes.
+ */
+static pid_t sv_spawn(const char *file, char **argv, const char *cwd,
+                      char **envp, int fds[3], int *fexit) {
+  if (server < 0) return p_spawn(file, argv, cwd, envp, fds);
+  // Send the current cwd, environment, and PATH to search for the program,
+  // since they may have changed since the server started.
+  char dir[4096];
+  if (!cwd) cwd = getcwd(dir, sizeof(dir)) ? dir : "";
+  if (!envp) envp = environ;
+  const char *path = getenv("PATH");
+  Request r = {0, 0, path != NULL, strlen(cwd) + 1 + strlen(file) + 1};
+  if (!path) path = "";
+  r.len += strlen(path) + 1;
+  for (; argv[r.argc]; r.argc++) r.len += strlen(argv[r.argc]) + 1;
+  for (; envp[r.envc]; r.envc++) r.len += strlen(envp[r.envc]) + 1;
+  char *strs = malloc(r.len), *s = strs;
+  if (!strs) return (errno = ENOMEM, -1);
+  for (int i = 0; i < r.argc + r.envc + 3; i++) {
+    const char *t = (i < r.argc) ? argv[i] : (i < r.argc + r.envc) ?
+      envp[i - r.argc] : (i == r.argc + r.envc) ? cwd :
+      (i == r.argc + r.envc + 1) ? file : path;
+    size_t len = strlen(t) + 1;
+    memcpy(s, t, len), s += len;
+  }
+  int status[2], reply[2] = {-1, 0};
+  if (p_pipe(status) < 0) return (free(strs), -1);
+  int ok = sv_io(server, &r, sizeof(Request),
+                 (int[]){fds[0], fds[1], fds[2], status[1]}, 4, 1) == 0 &&
+           sv_io(server, strs, r.len, NULL, 0, 1) == 0 &&
+           sv_io(server, reply, sizeof(reply), NULL, 0, 0) == 0;
+  free(strs), close(status[1]);
+  if (!ok) {
+    // The server has exited, so stop using it.
+    close(status[0]), close(server), server = -1;
+    return p_spawn(file, argv, *cwd ? cwd : NULL, envp, fds);
+  }
+  if (reply[0] > 0)
+    *fexit = status[0], fcntl(status[0], F_SETFL, O_NONBLOCK);
+  else
+    close(status[0]), errno = reply[1];
+  return reply[0];
+}
+#endif
+
+#if (!GTK || __APPLE__) && __linux__
+static int epfd = -1; // epoll instance created by lspawn_epollfd()
+// Each epoll event's data is a PStream pointer tagged with one of these kinds.
+// Lua userdata is at least 8-byte aligned, leaving 3 bits for the tag.
+#define EV_STDOUT 0
+#define EV_STDERR 1
+#define EV_EXIT 2
+#define EV_STDIN 3
+#define EV_TIMER 4 // the deadline timer, with a NULL pointer
+#define EV_QUEUE 5 // the background reader's queue, with a NULL pointer
+#define EV_MASK 7
+#define ev_proc(ev) ((PStream *)(uintptr_t)((ev).data.u64 & ~(uint64_t)EV_MASK))
+
+/** Registers process *p*'s fd *fd* of kind *kind* with the epoll instance. */
+static void ev_add(PStream *p, int fd, int kind) {
+  struct epoll_event ev = {(kind == EV_STDIN) ? EPOLLOUT : EPOLLIN,
+                           {.u64 = (uintptr_t)p | kind}};
+  epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/** Registers all of process *p*'s monitored fds with the epoll instance. */
+static void ev_watch(PStream *p) {
+  for (int err = 0; err < 2 && !p->reader; err++)
+    if (p_reading(p, err) && !(p->hups & (1 << err)))
+      ev_add(p, !err ? p->fstdout : p->fstderr, !err ? EV_STDOUT : EV_STDERR);
+  if (p->fexit >= 0) ev_add(p, p->fexit, EV_EXIT);
+  for (int i = 0; i < p->npids; i++)
+    if (p->pidfds[i] >= 0) ev_add(p, p->pidfds[i], EV_EXIT);
+  if (p->wqueue) ev_add(p, p->fstdin, EV_STDIN);
+}
+#endif
+
+#if (!GTK || __APPLE__)
+/**
+ * The background reader of a process' stdout and stderr. It is created by the
+ * main thread and handed to the background thread, which reads each fd until
+ * EOF and then sends a final message, after which the main thread frees it.
+ */
+typedef struct Reader {
+  PStream *p; // process (main thread only), or NULL once collected
+  int fds[2]; // stdout and stderr
+  int eof[2]; // whether or not each fd is at EOF (background thread only)
+  int paused[2]; // whether or not each fd is paused (set by the main thread)
+  size_t queued; // bytes of output queued and not yet passed to Lua
+  size_t high, low; // watermarks for queued, or 0
+  int stalled; // whether or not the thread stopped reading for too much queued
+} Reader;
+
+/** A block of output, or a reader's final message, from the background thread. */
+typedef struct Msg {
+  struct Msg *next;
+  Reader *r;
+  int err; // 0 for stdout, 1 for stderr, or 2 for the reader's final message
+  size_t len;
+  char data[];
+} Msg;
+
+// Lock-free queue of messages from the background thread to the main thread,
+// consumed at qtail and produced at qhead, with a stub message that keeps it
+// non-empty (Vyukov's intrusive MPSC queue).
+static Msg qstub, *qhead = &qstub, *qtail = &qstub;
+static int qfd[2] = {-1, -1}; // fds signaled when messages are waiting
+static int qsignaled; // whether or not qfd has been signaled since drained
+static int bgctl = -1; // pipe for handing readers to the background thread
+
+/** Appends message *m* to the queue (background thread). */
+static void q_put(Msg *m) {
+  __atomic_store_n(&m->next, NULL, __ATOMIC_RELAXED);
+  Msg *prev = __atomic_exchange_n(&qhead, m, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+/**
+ * Removes and returns the next message in the queue, or NULL if there is none
+ * yet (main thread).
+ */
+static Msg *q_get(void) {
+  Msg *tail = qtail, *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &qstub) {
+    if (!next) return NULL;
+    qtail = tail = next, next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) return (qtail = next, tail);
+  if (tail != __atomic_load_n(&qhead, __ATOMIC_ACQUIRE))
+    return NULL; // the background thread is still appending a message
+  q_put(&qstub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  return next ? (qtail = next, tail) : NULL;
+}
+
+/**
+ * Signals the main thread that messages are waiting, unless it has already been
+ * signaled and has not drained the queue since (background thread).
+ */
+static void q_notify(void) {
+  if (__atomic_exchange_n(&qsignaled, 1, __ATOMIC_ACQ_REL)) return;
+  uint64_t one = 1;
+  while (write(qfd[1], &one, (qfd[1] == qfd[0]) ? sizeof(one) : 1) < 0 &&
+         errno == EINTR) ;
+}
+
+/**
+ * Sends message *err* with *len* bytes *data* for reader *r* to the main
+ * thread (background thread).
+ */
+static void bg_send(Reader *r, int err, const char *data, size_t len) {
+  Msg *m;
+  __atomic_add_fetch(&r->queued, len, __ATOMIC_SEQ_CST);
+  while (!(m = malloc(sizeof(Msg) + len))) usleep(1000); // wait for memory
+  m->r = r, m->err = err, m->len = len, memcpy(m->data, data, len);
+  q_put(m);
+}
+
+/**
+ * Returns whether or not reader *r* has queued as much output as its high
+ * watermark allows, noting that the background thread is waiting for the main
+ * thread to pass it to Lua if so (background thread).
+ */
+static int bg_full(Reader *r) {
+  if (!r->high || __atomic_load_n(&r->queued, __ATOMIC_SEQ_CST) < r->high)
+    return 0;
+  __atomic_store_n(&r->stalled, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&r->queued, __ATOMIC_SEQ_CST) >= r->high;
+}
+
+/**
+ * Runs the background thread, which reads the output of the processes whose
+ * readers it receives over pipe *ctl* and queues it for the main thread.
+ */
+static void *bg_main(void *ctl) {
+  int fd = (int)(intptr_t)ctl, n = 0, size = 0;
+  Reader **readers = NULL;
+  struct pollfd *pfds = NULL;
+  static char buf[READ_BUFSIZ];
+  for (;;) {
+    if (size < n + 1) {
+      size = 2 * (n + 1);
+      void *t = realloc(readers, size * sizeof(Reader *));
+      if (t) readers = t;
+      if ((t = realloc(pfds, (2 * size + 1) * sizeof(struct pollfd)))) pfds = t;
+      if (!readers || !pfds) return NULL;
+    }
+    pfds[0].fd = fd, pfds[0].events = POLLIN;
+    for (int i = 0; i < 2 * n; i++) {
+      Reader *r = readers[i / 2];
+      int skip = r->eof[i % 2] || bg_full(r) ||
+                 __atomic_load_n(&r->paused[i % 2], __ATOMIC_SEQ_CST);
+      pfds[i + 1].fd = !skip ? r->fds[i % 2] : -1; // -1 is ignored
+      pfds[i + 1].events = POLLIN;
+    }
+    if (poll(pfds, 2 * n + 1, -1) < 0) continue;
+    int sent = 0;
+    for (int i = 0; i < 2 * n; i++) {
+      Reader *r = readers[i / 2];
+      if (!pfds[i + 1].revents || r->eof[i % 2]) continue;
+      ssize_t len = read(r->fds[i % 2], buf, READ_BUFSIZ);
+      if (len > 0) bg_send(r, i % 2, buf, len), sent = 1;
+      else if (len == 0 || (errno != EAGAIN && errno != EINTR))
+        r->eof[i % 2] = 1; // EOF, or EIO from a pseudo-terminal
+    }
+    // Stop reading for readers at EOF, and send their final messages.
+    for (int i = n - 1; i >= 0; i--)
+      if (readers[i]->eof[0] && readers[i]->eof[1])
+        bg_send(readers[i], 2, NULL, 0), readers[i] = readers[--n], sent = 1;
+    if (sent) q_notify();
+    // Receive new readers, or NULL to look at existing ones again.
+    Reader *r;
+    while (pfds[0].revents && n < size && read(fd, &r, sizeof(r)) == sizeof(r))
+      if (r) readers[n++] = r;
+  }
+}
+
+/**
+ * Starts the background thread, returning 0 on success or -1.
+ * The thread does not handle signals.
+ */
+static int bg_start(void) {
+  int ctl[2];
+  if (p_pipe(ctl) < 0) return -1;
+  fcntl(ctl[0], F_SETFL, O_NONBLOCK);
+#if __linux__
+  qfd[0] = qfd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+  if (p_pipe(qfd) == 0)
+    fcntl(qfd[0], F_SETFL, O_NONBLOCK), fcntl(qfd[1], F_SETFL, O_NONBLOCK);
+#endif
+  pthread_t thread;
+  pthread_attr_t attr;
+  sigset_t all, old;
+  sigfillset(&all);
+  int error = qfd[0] < 0 || pthread_attr_init(&attr) != 0;
+  if (!error) {
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    error = pthread_create(&thread, &attr, bg_main, (void *)(intptr_t)ctl[0]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL), pthread_attr_destroy(&attr);
+  }
+  if (error) {
+    close(ctl[0]), close(ctl[1]);
+    if (qfd[0] >= 0) close(qfd[0]);
+    if (qfd[1] != qfd[0]) close(qfd[1]);
+    return (qfd[0] = qfd[1] = -1);
+  }
+  bgctl = ctl[1];
+#if __linux__
+  if (epfd >= 0) ev_add(NULL, qfd[0], EV_QUEUE);
+#endif
+  return 0;
+}
+
+/**
+ * Hands process *p*'s stdout and stderr to the background thread, starting it
+ * if necessary. On failure, the main thread keeps reading them.
+ */
+static void bg_watch(PStream *p) {
+  if (bgctl < 0 && bg_start() < 0) return;
+  Reader *r = malloc(sizeof(Reader));
+  if (!r) return;
+  r->p = p, r->fds[0] = p->fstdout, r->fds[1] = p->fstderr;
+  r->eof[0] = r->eof[1] = 0;
+  r->paused[0] = !p_reading(p, 0), r->paused[1] = !p_reading(p, 1);
+  r->queued = 0, r->high = p->high, r->low = p->low, r->stalled = 0;
+  if (write(bgctl, &r, sizeof(r)) == sizeof(r)) p->reader = r; else free(r);
+}
+
+/** Has the background thread look at its readers' fds again. */
+static void bg_nudge(void) {
+  Reader *none = NULL;
+  while (write(bgctl, &none, sizeof(none)) < 0 && errno == EINTR) ;
+}
+
+static PStream **deadlines; // min-heap of processes ordered by deadline
+static int ndeadlines, deadlines_size;
+static int tfd = -1; // timerfd armed for the earliest deadline (Linux only)
+
+/**
+ * Returns the time process *p* next needs attention: the earlier of its next
+ * deadline signal and the timeout of a coroutine's wait, or 0 for neither.
+ */
+static double dl_next(PStream *p) {
+  if (!p->dkill || !p->wakeup) return p->dkill ? p->dkill : p->wakeup;
+  return (p->dkill < p->wakeup) ? p->dkill : p->wakeup;
+}
+
+/** Swaps the processes at indices *i* and *j* of the deadline heap. */
+static void dl_swap(int i, int j) {
+  PStream *p = deadlines[i];
+  deadlines[i] = deadlines[j], deadlines[j] = p;
+  deadlines[i]->dlindex = i, deadlines[j]->dlindex = j;
+}
+
+/** Moves the process at index *i* of the deadline heap into its place. */
+static void dl_fix(int i) {
+  for (; i > 0 && deadlines[i]->deadline < deadlines[(i - 1) / 2]->deadline;
+       i = (i - 1) / 2)
+    dl_swap(i, (i - 1) / 2);
+  for (int child; (child = 2 * i + 1) < ndeadlines; i = child) {
+    if (child + 1 < ndeadlines &&
+        deadlines[child + 1]->deadline < deadlines[child]->deadline)
+      child++;
+    if (deadlines[i]->deadline <= deadlines[child]->deadline) break;
+    dl_swap(i, child);
+  }
+}
+
+/**
+ * Sets process *p*'s deadline to time *t* in seconds, or removes it if *t* is
+ * 0, and returns 0 on success or -1 if out of memory.
+ * Call `dl_arm()` afterwards.
+ */
+static int dl_set(PStream *p, double t) {
+  if (t <= 0) {
+    if (p->dlindex < 0) return 0;
+    int i = p->dlindex;
+    dl_swap(i, --ndeadlines), p->dlindex = -1;
+    if (i < ndeadlines) dl_fix(i);
+    return 0;
+  }
+  if (p->dlindex < 0) {
+    if (ndeadlines == deadlines_size) {
+      int size = deadlines_size ? 2 * deadlines_size : 16;
+      PStream **heap = realloc(deadlines, size * sizeof(PStream *));
+      if (!heap) return -1;
+      deadlines = heap, deadlines_size = size;
+    }
+    deadlines[ndeadlines] = p, p->dlindex = ndeadlines++;
+  }
+  p->deadline = t, dl_fix(p->dlindex);
+  return 0;
+}
+
+/** Arms the deadline timer for the earliest deadline, or disarms it. */
+static void dl_arm(void) {
+#if __linux__
+  if (tfd < 0 && ndeadlines) {
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd >= 0 && epfd >= 0) ev_add(NULL, tfd, EV_TIMER);
+  }
+  if (tfd < 0) return;
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (ndeadlines) {
+    double t = deadlines[0]->deadline; // p_now() uses the same clock
+    its.it_value.tv_sec = t, its.it_value.tv_nsec = (t - (time_t)t) * 1e9 + 1;
+    if (its.it_value.tv_nsec >= 1000000000)
+      its.it_value.tv_sec++, its.it_value.tv_nsec -= 1000000000;
+  }
+  // Should arming fail, do without the timer like elsewhere, and have
+  // lspawn_readfds() and lspawn_dispatch() enforce deadlines when called.
+  if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    close(tfd), tfd = -1; // also removes it from the epoll set
+#endif
+}
+
+/** Updates process *p*'s place in the deadline heap and rearms the timer. */
+static void p_schedule(PStream *p) {
+  if (dl_set(p, dl_next(p)) == 0) dl_arm();
+}
+
+/**
+ * Signals processes whose deadlines have passed, schedules SIGKILL for those
+ * whose grace periods start, and resumes coroutines whose waits time out.
+ */
+static void dl_expire(void) {
+#if __linux__
+  uint64_t expirations;
+  if (tfd >= 0) read(tfd, &expirations, sizeof(uint64_t));
+#endif
+  double now = p_now();
+  while (ndeadlines && deadlines[0]->deadline <= now) {
+    PStream *p = deadlines[0];
+    if (p->dkill && p->dkill <= now) {
+      if (events) p_trace(p, now, 'i', "deadline", p->dsignal);
+      p_kill(p, p->dsignal);
+      if (p->dsignal != SIGKILL)
+        p->dsignal = SIGKILL, p->dkill = now + p->grace;
+      else
+        p->dkill = 0;
+    }
+    int wake = p->wakeup && p->wakeup <= now;
+    if (wake) p->wakeup = 0;
+    dl_set(p, dl_next(p));
+    if (wake) p_resume(p, (lua_pushboolean(p->co, 0), 1)); // wait timed out
+  }
+  dl_arm();
+}
+
+/** Starts process *p*'s deadline. */
+static void p_startdeadline(PStream *p) {
+  p->dkill = p_now() + p->timeout, p_schedule(p);
+}
+#endif
+
+/**
+ * Resumes the coroutine waiting in process *p*'s `proc:read()` or `proc:wait()`
+ * with the *nresults* results at the top of its stack, reporting any error.
+ */
+static void p_resume(PStream *p, int nresults) {
+  lua_State *co = p->co;
+  int ref = p->coref;
+  p->co = NULL, p->coref = LUA_NOREF;
+#if (GTK && !__APPLE__)
+  if (p->cowatch) g_source_remove(p->cowatch), p->cowatch = 0;
+#else
+  if (p->wakeup) p->wakeup = 0, p_schedule(p);
+#endif
+#if LUA_VERSION_NUM >= 504
+  int nres, status = lua_resume(co, p->L, nresults, &nres);
+#elif LUA_VERSION_NUM >= 502
+  int status = lua_resume(co, p->L, nresults), nres = lua_gettop(co);
+#else
+  int status = lua_resume(co, nresults), nres = lua_gettop(co);
+#endif
+  if (status == LUA_OK || status == LUA_YIELD)
+    lua_pop(co, nres); // discard any values yielded or returned
+  else
+    fprintf(stderr, "Lua: %s\n", lua_tostring(co, -1)), lua_pop(co, 1);
+  luaL_unref(p->L, LUA_REGISTRYINDEX, ref);
+}
+
+#if (GTK && !__APPLE__)
+/** Signal that the wait of the coroutine waiting on process *p* timed out. */
+static int p_wake(void *data) {
+  PStream *p = (PStream *)data;
+  p->cowatch = 0, p_resume(p, (lua_pushboolean(p->co, 0), 1));
+  return FALSE;
+}
+#endif
+
+#if (!GTK || __APPLE__)
+/** Adds the resource usage *ru* of a finished process to process *p*'s. */
+static void p_addrusage(PStream *p, struct rusage *ru) {
+  struct rusage *sum = &p->rusage;
+  timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+  timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+  if (ru->ru_maxrss > sum->ru_maxrss) sum->ru_maxrss = ru->ru_maxrss;
+  sum->ru_nvcsw += ru->ru_nvcsw, sum->ru_nivcsw += ru->ru_nivcsw;
+  sum->ru_inblock += ru->ru_inblock, sum->ru_oublock += ru->ru_oublock;
+  p->hasrusage = 1;
+}
+
+/**
+ * Returns whether or not process *p* has finished, reaping it and storing its
+ * exit status in *status* and its resource usage in *p* if so.
+ * *options* are `waitpid()` options, normally `WNOHANG`.
+ */
+static int p_reap(PStream *p, int *status, int options) {
+  struct rusage ru;
+  if (p->served) {
+    // The spawn server reaps the process and writes its exit status and
+    // resource usage, or exits first and closes the pipe.
+    Exit e;
+    ssize_t n = read(p->fexit, &e, sizeof(Exit));
+    if (n == sizeof(Exit)) *status = e.status, p_addrusage(p, &e.rusage);
+    return n == sizeof(Exit) || (n == 0 && (*status = -1, 1));
+  }
+  if (!p->npids) {
+    if (wait4(p->pid, status, options, &ru) <= 0) return 0;
+    return (p_addrusage(p, &ru), 1);
+  }
+  // A pipeline has finished only once all of its stages have.
+  int running = 0;
+  for (int i = 0; i < p->npids; i++) {
+    if (p->statuses[i] != -1) continue;
+    if (wait4(p->pids[i], &p->statuses[i], options, &ru) <= 0) {
+      p->statuses[i] = -1, running++;
+      continue;
+    }
+    p_addrusage(p, &ru);
+    // A reaped stage's exit fd stays ready forever, so stop monitoring it.
+    if (p->pidfds[i] >= 0) close(p->pidfds[i]), p->pidfds[i] = -1;
+  }
+  return !running && (*status = p->statuses[p->npids - 1], 1);
+}
+#endif
+
+#if !_WIN32
+/**
+ * Writes the *n* buffers *iov* to fd *fd* like `writev()`, retrying if
+ * interrupted, but fails with `EPIPE` instead of raising `SIGPIPE` if the
+ * reader has gone away, so a process that closes its stdin cannot kill the
+ * application.
+ */
+static ssize_t p_writev(int fd, const struct iovec *iov, int n) {
+  sigset_t sigpipe, pending, mask;
+  sigemptyset(&sigpipe), sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &mask);
+  sigpending(&pending);
+  int was_pending = sigismember(&pending, SIGPIPE);
+  ssize_t len;
+  while ((len = writev(fd, iov, n)) < 0 && errno == EINTR) ;
+  int error = errno;
+  // Consume the SIGPIPE this write raised, unless it was ignored and discarded.
+  if (len < 0 && error == EPIPE && !was_pending && sigpending(&pending) == 0 &&
+      sigismember(&pending, SIGPIPE)) {
+    int sig;
+    sigwait(&sigpipe, &sig);
+  }
+  pthread_sigmask(SIG_SETMASK, &mask, NULL);
+  return (errno = error, len);
+}
+
+/** Frees queued input chunk *c*, unmapping any file it points into. */
+static void c_free(Chunk *c) {
+  if (c->map) munmap(c->map, c->maplen);
+  free(c);
+}
+
+/** Discards process *p*'s queued input. */
+static void p_dropqueue(PStream *p) {
+  for (Chunk *c; (c = p->wqueue); c_free(c)) p->wqueue = c->next;
+  p->wtail = NULL, p->wqueued = 0;
+}
+
+/**
+ * Writes as much of process *p*'s queued input to its stdin as possible without
+ * blocking, and returns the number of bytes still queued.
+ * Once the queue has been written, stops monitoring stdin, closes it if
+ * `proc:close()` was called in the meantime, and calls the drain callback.
+ */
+static size_t p_flush(PStream *p) {
+  if (!p->wqueue) return 0;
+  while (p->wqueue) {
+    struct iovec iov[16];
+    int n = 0;
+    for (Chunk *c = p->wqueue; c && n < 16; c = c->next, n++)
+      iov[n].iov_base = c->data + c->pos, iov[n].iov_len = c->len - c->pos;
+    ssize_t len = p_writev(p->fstdin, iov, n);
+    p_countwrite(p, len);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return p->wqueued;
+    if (len < 0) {
+      p_dropqueue(p), p->wclose = 1; // the process closed its stdin
+      break;
+    }
+    p->wqueued -= len;
+    for (Chunk *c; (c = p->wqueue) && (size_t)len >= c->len - c->pos; c_free(c))
+      len -= c->len - c->pos, p->wqueue = c->next;
+    if (p->wqueue) p->wqueue->pos += len;
+  }
+  p->wtail = NULL;
+#if (GTK && !__APPLE__)
+  g_source_remove(p->wwatch), p->wwatch = 0;
+#elif __linux__
+  if (epfd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, p->fstdin, NULL);
+#endif
+  if (p->wclose) close(p->fstdin), p->fstdin = -1, p->wclose = 0;
+  if (p->drain_cb > 0) p_callback(p, p->drain_cb, 0);
+  return 0;
+}
+
+#if (GTK && !__APPLE__)
+/** Signal that stdin can be written to. */
+static int ch_write(int fd, GIOCondition cond, void *data) {
+  PStream *p = (PStream *)data;
+  return p_flush(p) > 0;
+}
+#endif
+
+/**
+ * Appends chunk *c* to process *p*'s queued input, monitoring stdin until the
+ * queue has been written.
+ */
+static void p_enqueue(PStream *p, Chunk *c) {
+  if (!p->wqueue) {
+    p->wqueue = c;
+#if (GTK && !__APPLE__)
+    p->wwatch = g_unix_fd_add(p->fstdin, G_IO_OUT, ch_write, p);
+#elif __linux__
+    if (epfd >= 0) ev_add(p, p->fstdin, EV_STDIN);
+#endif
+  } else p->wtail->next = c;
+  p->wtail = c, p->wqueued += c->len;
+}
+
+/**
+ * Writes the contents of the file open as *fd* to process *p*'s stdin like
+ * `proc:write()`, but queues what cannot be written yet by mapping the file
+ * instead of copying it, and returns 0 on success or -1 with errno set.
+ */
+static int p_writefile(PStream *p, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) return -1;
+  if (st.st_size == 0 || p->fstdin < 0 || p->wclose) return 0;
+  size_t size = st.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+  posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+  ssize_t n = 0;
+  if (!p->wqueue) n = p_writev(p->fstdin, &(struct iovec){map, size}, 1);
+  p_countwrite(p, n);
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    close(p->fstdin), p->fstdin = -1; // the process closed its stdin
+    return (munmap(map, size), 0);
+  }
+  if (n < 0) n = 0;
+  if ((size_t)n == size) return (munmap(map, size), 0);
+  Chunk *c = malloc(sizeof(Chunk));
+  if (!c) return (munmap(map, size), errno = ENOMEM, -1);
+  c->next = NULL, c->data = map + n, c->len = size - n, c->pos = 0;
+  c->map = map, c->maplen = size;
+  return (p_enqueue(p, c), 0);
+}
+
+/**
+ * Returns a close-on-exec fd greater than 2 for a child's stdin, duplicated
+ * from the fd or opened from the file named by the value at index *index*, or
+ * -1 with errno set on failure.
+ */
+static int p_openstdin(lua_State *L, int index) {
+  int number = lua_type(L, index) == LUA_TNUMBER;
+  const char *path = !number ? lua_tostring(L, index) : NULL;
+  if (!number && !path) return (errno = EINVAL, -1);
+  int fd = number ? lua_tointeger(L, index) : open(path, O_RDONLY);
+  if (fd < 0 && !number) return -1; // an invalid fd fails below
+  int stdin_fd = fcntl(fd, F_DUPFD, 3), error = errno;
+  if (stdin_fd >= 0) fcntl(stdin_fd, F_SETFD, FD_CLOEXEC);
+  if (!number) close(fd);
+  return (errno = error, stdin_fd);
+}
+#endif
+
+/** p:status() Lua function. */
+static int lp_status(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  lua_pushstring(L, p->pid ? "running" : "terminated");
+  return 1;
+}
+
+#if !_WIN32
+/**
+ * Waits up to *ms* milliseconds (-1 for indefinitely) for process *pid* to
+ * finish and returns whether or not it has, leaving it to be reaped and
+ * signaled as usual.
+ * If *fd* is not -1, it is the process' exit fd, which is polled instead.
+ */
+static int p_waitpid(pid_t pid, int fd, int ms) {
+  int n;
+  if (fd >= 0) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while ((n = poll(&pfd, 1, ms)) < 0 && errno == EINTR) ;
+    return n != 0;
+  }
+  // Without an exit fd, waiting cannot time out, so check periodically.
+  for (int waited = 0;; waited += 10) {
+    siginfo_t info;
+    info.si_pid = 0;
+    int flags = WEXITED | WNOWAIT | ((ms >= 0) ? WNOHANG : 0);
+    while ((n = waitid(P_PID, pid, &info, flags)) < 0 && errno == EINTR) ;
+    if (n < 0 || info.si_pid) return 1;
+    if (waited >= ms) return 0;
+    usleep(((ms - waited < 10) ? ms - waited : 10) * 1000);
+  }
+}
+#endif
+
+/**
+ * Waits up to *ms* milliseconds (-1 for indefinitely) for process *p* to finish
+ * and returns whether or not it has.
+ */
+static int p_wait(PStream *p, int ms) {
+#if !_WIN32
+  int finished = 1;
+#if (!GTK || __APPLE__)
+  double deadline = p_now() + ms / 1000.0;
+  for (int i = 0; i < p->npids && finished; i++) {
+    double now = p_now();
+    int left = (ms < 0) ? -1 : (deadline > now) ? (deadline - now) * 1000 : 0;
+    if (p->statuses[i] == -1)
+      finished = p_waitpid(p->pids[i], p->pidfds[i], left);
+  }
+  if (!p->npids) finished = p_waitpid(p->pid, p->fexit, ms);
+#else
+  finished = p_waitpid(p->pid, -1, ms);
+#endif
+#else
+  int finished = WaitForSingleObject(p->pid, (ms >= 0) ? ms : INFINITE) ==
+                 WAIT_OBJECT_0;
+#endif
+  return finished;
+}
+
+/** p:wait() Lua function. */
+static int lp_wait(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  luaL_argcheck(L, p->pid, 1, "process terminated");
+  double timeout = luaL_optnumber(L, 2, -1);
+  int ms = lua_isnoneornil(L, 2) ? -1 : (timeout > 0) ? timeout * 1000 : 0;
+  if (p->yield && ms != 0 && l_isyieldable(L) && !p_wait(p, 0)) {
+    // Let the event loop resume this coroutine once the process finishes.
+    luaL_argcheck(L, !p->co, 1, "another coroutine is waiting");
+#if (GTK && !__APPLE__)
+    if (ms > 0) p->cowatch = g_timeout_add(ms, p_wake, p);
+#else
+    if (ms > 0) p->wakeup = p_now() + ms / 1000.0, p_schedule(p);
+#endif
+    return p_yield(L, p, 'w', 0);
+  }
+  return (lua_pushboolean(L, p_wait(p, ms)), 1);
+}
+
+#if !_WIN32
+/**
+ * Reads from process *p*'s stdout into the end of its read buffer with a single
+ * `read()` and returns that call's result, noting when stdout has ended.
+ */
+static ssize_t p_fill(PStream *p) {
+  if (p_reserve(p, BUFSIZ) < 0) return (errno = ENOMEM, -1);
+  ssize_t len;
+  struct pollfd pfd = {p->fstdout, POLLIN, 0};
+  // A pseudo-terminal's stdout shares stdin's non-blocking mode, and reports
+  // EIO instead of EOF once the child side is closed.
+  while ((len = read(p->fstdout, p->buf + p->buflen,
+                     p->bufsize - p->buflen)) < 0 &&
+         (errno == EAGAIN || errno == EWOULDBLOCK))
+    poll(&pfd, 1, -1);
+  if (len < 0 && errno == EIO) len = 0;
+  p_countread(p, 0, len);
+  if (len > 0) p->buflen += len;
+  if (len == 0) p->eof = 1;
+  return len;
+}
+
+/**
+ * Reads available output from process *p*'s stdout into its read buffer for
+ * `proc:read()`, and resumes any coroutine waiting to read it.
+ */
+static void p_buffer(PStream *p) {
+  struct pollfd pfd = {p->fstdout, POLLIN, 0};
+  while (!p->eof && !p_throttle(p) && poll(&pfd, 1, 0) > 0 &&
+         p_fill(p) >= BUFSIZ) ;
+  p_wakereader(p), p_throttle(p);
+}
+#endif
+
+/** p:read() Lua function. */
+static int lp_read(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  // Output buffered for a coroutine remains readable after the process exits.
+  luaL_argcheck(L, p->pid || p->yield, 1, "process terminated");
+#if (!GTK || __APPLE__)
+  luaL_argcheck(L, !p->reader || p->yield, 1,
+                "output is read in the background");
+#endif
+  char *c = (char *)luaL_optstring(L, 2, "l");
+  if (*c == '*') c++; // skip optional '*' (for compatibility)
+  luaL_argcheck(L, *c == 'l' || *c == 'L' || *c == 'a' || lua_isnumber(L, 2), 2,
+                   "invalid option");
+#if !_WIN32
+  if (p->yield) {
+    char mode = lua_isnumber(L, 2) ? 'n' : *c;
+    size_t bytes = (mode == 'n') ? (size_t)lua_tointeger(L, 2) : 0;
+    while (!p_canread(p, mode)) {
+      if (l_isyieldable(L)) {
+        // Let the event loop resume this coroutine once output arrives.
+        luaL_argcheck(L, !p->co, 1, "another coroutine is waiting");
+        return p_yield(L, p, mode, bytes);
+      }
+#if (!GTK || __APPLE__)
+      luaL_argcheck(L, !p->reader, 1, "output is read in the background");
+#endif
+      if (p_fill(p) < 0 && errno != EINTR) {
+        lua_pushnil(L), lua_pushinteger(L, errno);
+        lua_pushstring(L, strerror(errno));
+        return 3;
+      }
+    }
+    return p_pushread(L, p, mode, bytes);
+  }
+#endif
+#if _WIN32
+  char *buf = NULL;
+  size_t len = 0;
+  GError *error = NULL;
+  GIOStatus status = G_IO_STATUS_NORMAL;
+  if (!g_io_channel_get_buffered(p->cstdout))
+    g_io_channel_set_buffered(p->cstdout, TRUE); // needed for functions below
+  if (!lua_isnumber(L, 2)) {
+    if (*c == 'l' || *c == 'L') {
+      GString *s = g_string_new(NULL);
+      status = g_io_channel_read_line_string(p->cstdout, s, NULL, &error);
+      len = s->len, buf = g_string_free(s, FALSE);
+    } else if (*c == 'a') {
+      status = g_io_channel_read_to_end(p->cstdout, &buf, &len, &error);
+      if (status == G_IO_STATUS_EOF) status = G_IO_STATUS_NORMAL;
+    }
+  } else {
+    size_t bytes = (size_t)lua_tointeger(L, 2);
+    buf = malloc(bytes);
+    status = g_io_channel_read_chars(p->cstdout, buf, bytes, &len, &error);
+  }
+  p_countread(p, 0, len);
+  if ((g_io_channel_get_buffer_condition(p->cstdout) & G_IO_IN) == 0)
+    g_io_channel_set_buffered(p->cstdout, FALSE); // needed for stdout callback
+  lua_pushlstring(L, buf, len - ((buf[len - 1] == '\n' && *c == 'l') ? 1 : 0));
+  free(buf);
+  if (status != G_IO_STATUS_NORMAL) {
+    lua_pushnil(L);
+    if (status == G_IO_STATUS_EOF) return 1;
+    lua_pushinteger(L, error->code), lua_pushstring(L, error->message);
+    return 3;
+  } else return 1;
+#else
+  ssize_t n = 1;
+  size_t len = 0;
+  if (!lua_isnumber(L, 2)) {
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    while (p->bufpos < p->buflen || (n = p_fill(p)) > 0) {
+      char *s = p->buf + p->bufpos, *end = p->buf + p->buflen;
+      char *nl = (*c != 'a') ? memchr(s, '\n', end - s) : NULL;
+      size_t chunk = (nl ? nl + 1 : end) - s;
+      luaL_addlstring(&buf, s, chunk - ((nl && *c == 'l') ? 1 : 0));
+      p->bufpos += chunk, len += chunk;
+      if (nl) break;
+    }
+    luaL_pushresult(&buf);
+  } else {
+    size_t bytes = (size_t)lua_tointeger(L, 2);
+    if (p->bufpos < p->buflen || (n = p_fill(p)) > 0) {
+      len = p->buflen - p->bufpos;
+      if (len > bytes) len = bytes;
+      lua_pushlstring(L, p->buf + p->bufpos, len), p->bufpos += len;
+    }
+  }
+  if (len == 0) {
+    lua_pushnil(L);
+    if (n >= 0) return 1;
+    lua_pushinteger(L, errno), lua_pushstring(L, strerror(errno));
+    return 3;
+  } else return 1;
+#endif
+}
+
+/** p:write() Lua function. */
+static int lp_write(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  luaL_argcheck(L, p->pid, 1, "process terminated");
+  for (int i = 2; i <= lua_gettop(L); i++) {
+    size_t len;
+    const char *s = luaL_checklstring(L, i, &len);
+#if !_WIN32
+    if (p->fstdin < 0 || p->wclose) continue; // stdin was closed
+    ssize_t n = 0;
+    if (!p->wqueue) n = p_writev(p->fstdin, &(struct iovec){(char *)s, len}, 1);
+    p_countwrite(p, n);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      close(p->fstdin), p->fstdin = -1; // the process closed its stdin
+      continue;
+    }
+    if (n < 0) n = 0;
+    if ((size_t)n == len) continue;
+    // Queue what could not be written without blocking.
+    Chunk *c = malloc(sizeof(Chunk) + len - n);
+    if (!c) return luaL_error(L, "out of memory");
+    c->next = NULL, c->data = (char *)(c + 1), c->len = len - n, c->pos = 0;
+    c->map = NULL, c->maplen = 0;
+    memcpy(c->data, s + n, c->len);
+    p_enqueue(p, c);
+#else
+    DWORD len_written;
+    WriteFile(p->fstdin, s, len, &len_written, NULL);
+    p_countwrite(p, len_written);
+#endif
+  }
+#if !_WIN32
+  return (lua_pushinteger(L, p->wqueued), 1);
+#else
+  return 0;
+#endif
+}
+
+/** p:writefile() Lua function. */
+static int lp_writefile(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  luaL_argcheck(L, p->pid, 1, "process terminated");
+  const char *path = luaL_checkstring(L, 2);
+#if !_WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || p_writefile(p, fd) < 0) {
+    int error = errno;
+    if (fd >= 0) close(fd);
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", path, strerror(error));
+    return 2;
+  }
+  close(fd); // any mapping remains
+  return (lua_pushinteger(L, p->wqueued), 1);
+#else
+  return luaL_error(L, "not implemented in this environment");
+#endif
+}
+
+/** p:pending() Lua function. */
+static int lp_pending(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+#if !_WIN32
+  lua_pushinteger(L, p->wqueued);
+#else
+  lua_pushinteger(L, 0);
+#endif
+  return 1;
+}
+
+/** p:ondrain() Lua function. */
+static int lp_ondrain(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  luaL_argcheck(L, p->pid, 1, "process terminated");
+  luaL_unref(L, LUA_REGISTRYINDEX, p->drain_cb);
+  p->drain_cb = l_reffunction(L, 2);
+  return 0;
+}
+
+/** p:close() Lua function. */
+static int lp_close(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  luaL_argcheck(L, p->pid, 1, "process terminated");
+#if !_WIN32
+  if (p->wqueue) p->wclose = 1; // close once queued input has been written
+  else if (p->fstdin >= 0) close(p->fstdin), p->fstdin = -1;
+  return 0;
+#else
+  return (close(p->fstdin), 0);
+#endif
+}
+
+/** p:kill() Lua function. */
+static int lp_kill(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  if (p->pid) p_kill(p, luaL_optinteger(L, 2, SIGKILL));
+  return 0;
+}
+
+#if (!GTK || __APPLE__)
+/** p:resize() Lua function. */
+static int lp_resize(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  luaL_argcheck(L, p->pid, 1, "process terminated");
+  luaL_argcheck(L, p->pty, 1, "no pseudo-terminal");
+  int cols = luaL_checkinteger(L, 2), rows = luaL_checkinteger(L, 3);
+#ifdef TIOCSWINSZ
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws)), ws.ws_col = cols, ws.ws_row = rows;
+  ioctl(p->fstdout, TIOCSWINSZ, &ws);
+#endif
+  // The terminal is not the process' controlling terminal, so notify it.
+  return (p_kill(p, SIGWINCH), 0);
+}
+#endif
+
+/** p:statuses() Lua function. */
+static int lp_statuses(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+#if (!GTK || __APPLE__)
+  lua_createtable(L, p->npids, 0);
+  for (int i = 0; i < p->npids; i++) {
+    if (p->statuses[i] != -1)
+      lua_pushinteger(L, p->statuses[i]);
+    else
+      lua_pushboolean(L, 0); // still running
+    lua_rawseti(L, -2, i + 1);
+  }
+  return p->npids ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+/** p:output() Lua function. */
+static int lp_output(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  static const char *const streams[] = {"stdout", "stderr", NULL};
+  Ring *r = &p->capture[luaL_checkoption(L, 2, "stdout", streams)];
+  if (!r->size) return 0;
+  if (r->total <= r->size)
+    lua_pushlstring(L, r->s, r->total);
+  else {
+    // The oldest byte is where the next one would be added.
+    size_t pos = r->total % r->size;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, r->s + pos, r->size - pos);
+    luaL_addlstring(&b, r->s, pos);
+    luaL_pushresult(&b);
+  }
+  lua_pushinteger(L, r->total);
+  return 2;
+}
+
+/**
+ * Pushes onto the stack a table of statistics *s*, which are `totals` if
+ * *global* is non-zero.
+ */
+static void l_pushstats(lua_State *L, Stats *s, int global) {
+  lua_createtable(L, 0, 11);
+  lua_pushinteger(L, s->bytes[0]), lua_setfield(L, -2, "stdout_bytes");
+  lua_pushinteger(L, s->bytes[1]), lua_setfield(L, -2, "stderr_bytes");
+  lua_pushinteger(L, s->bytes[2]), lua_setfield(L, -2, "stdin_bytes");
+  lua_pushinteger(L, s->dropped[0]), lua_setfield(L, -2, "stdout_dropped");
+  lua_pushinteger(L, s->dropped[1]), lua_setfield(L, -2, "stderr_dropped");
+  lua_pushinteger(L, s->reads), lua_setfield(L, -2, "reads");
+  lua_pushinteger(L, s->callbacks), lua_setfield(L, -2, "callbacks");
+  lua_pushnumber(L, s->callback_time), lua_setfield(L, -2, "callback_time");
+  // Totals of times from spawning are averaged.
+  size_t n = global ? nspawned : 1;
+  size_t nfirst = global ? nfirstbytes : s->first_byte >= 0;
+  if (n) lua_pushnumber(L, s->spawn_time / n), lua_setfield(L, -2, "spawn_time");
+  if (nfirst) {
+    lua_pushnumber(L, s->first_byte / nfirst);
+    lua_setfield(L, -2, "first_byte");
+  }
+  if (global) lua_pushinteger(L, n), lua_setfield(L, -2, "spawns");
+}
+
+/** p:stats() Lua function. */
+static int lp_stats(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  return (l_pushstats(L, &p->stats, 0), 1);
+}
+
+#if (!GTK || __APPLE__)
+/** Pushes onto the stack a table of process *p*'s resource usage. */
+static void l_pushrusage(lua_State *L, PStream *p) {
+  struct rusage *ru = &p->rusage;
+#if __APPLE__
+  lua_Integer maxrss = ru->ru_maxrss; // bytes
+#else
+  lua_Integer maxrss = (lua_Integer)ru->ru_maxrss * 1024; // kilobytes
+#endif
+  lua_createtable(L, 0, 7);
+  lua_pushnumber(L, ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6);
+  lua_setfield(L, -2, "user_time");
+  lua_pushnumber(L, ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6);
+  lua_setfield(L, -2, "system_time");
+  lua_pushinteger(L, maxrss), lua_setfield(L, -2, "max_rss");
+  lua_pushinteger(L, ru->ru_nvcsw), lua_setfield(L, -2, "voluntary_switches");
+  lua_pushinteger(L, ru->ru_nivcsw);
+  lua_setfield(L, -2, "involuntary_switches");
+  lua_pushinteger(L, ru->ru_inblock), lua_setfield(L, -2, "input_blocks");
+  lua_pushinteger(L, ru->ru_oublock), lua_setfield(L, -2, "output_blocks");
+}
+#endif
+
+/** p:rusage() Lua function. */
+static int lp_rusage(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+#if (!GTK || __APPLE__)
+  if (p->hasrusage) return (l_pushrusage(L, p), 1);
+#endif
+  return (lua_pushnil(L), 1);
+}
+
+/** tostring(p) Lua function. */
+static int lp_tostring(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  if (p->pid)
+    lua_pushfstring(L, "process (pid=%d)", p->pid);
+  else
+    lua_pushstring(L, "process (terminated)");
+  return 1;
+}
+
+/** A `spawn()` request waiting in a job queue. */
+typedef struct {
+  int ref; // table of spawn() arguments, with their number in field "n"
+  double priority;
+  unsigned long seq; // order of submission, for running equal priorities FIFO
+} Job;
+
+/** A queue of jobs that runs at most a fixed number of processes at a time. */
+typedef struct Queue {
+  Job *jobs; // max-heap of waiting jobs
+  int njobs, size;
+  int limit, running; // maximum and current numbers of running processes
+  int ref; // keeps the queue alive while it has waiting or running jobs
+  unsigned long seq; // number of jobs ever submitted
+} Queue;
+
+static int spawn(lua_State *L);
+
+/** Returns whether or not job *a* runs before job *b*. */
+static int q_before(Job *a, Job *b) {
+  return a->priority > b->priority ||
+         (a->priority == b->priority && a->seq < b->seq);
+}
+
+/** Adds job *job* to queue *q*, returning 0 on success or -1. */
+static int q_push(Queue *q, Job job) {
+  if (q->njobs == q->size) {
+    int size = q->size ? 2 * q->size : 16;
+    Job *jobs = realloc(q->jobs, size * sizeof(Job));
+    if (!jobs) return -1;
+    q->jobs = jobs, q->size = size;
+  }
+  int i = q->njobs++;
+  for (; i > 0 && q_before(&job, &q->jobs[(i - 1) / 2]); i = (i - 1) / 2)
+    q->jobs[i] = q->jobs[(i - 1) / 2];
+  return (q->jobs[i] = job, 0);
+}
+
+/** Removes and returns queue *q*'s next job. */
+static Job q_pop(Queue *q) {
+  Job next = q->jobs[0], last = q->jobs[--q->njobs];
+  int i = 0;
+  for (int child; (child = 2 * i + 1) < q->njobs; i = child) {
+    if (child + 1 < q->njobs && q_before(&q->jobs[child + 1], &q->jobs[child]))
+      child++;
+    if (!q_before(&q->jobs[child], &last)) break;
+    q->jobs[i] = q->jobs[child];
+  }
+  if (q->njobs) q->jobs[i] = last;
+  return next;
+}
+
+/**
+ * Runs queue *q*'s waiting jobs while it has fewer than its limit of processes
+ * running, and releases the queue once it has no jobs left.
+ * A job that fails to spawn has its exit callback called with an exit status
+ * of -1 and the error message.
+ */
+static void q_next(lua_State *L, Queue *q) {
+  while (q->running < q->limit && q->njobs) {
+    Job job = q_pop(q);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, job.ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, job.ref);
+    int args = lua_gettop(L);
+    lua_getfield(L, args, "n");
+    int n = lua_tointeger(L, -1);
+    lua_pop(L, 1); // n
+    lua_pushcfunction(L, spawn);
+    for (int i = 1; i <= n; i++) lua_rawgeti(L, args, i);
+    if (lua_pcall(L, n, 2, 0) != LUA_OK) {
+      fprintf(stderr, "Lua: %s\n", lua_tostring(L, -1)), lua_pop(L, 2);
+      continue;
+    }
+    if (lua_isuserdata(L, -2)) {
+      ((PStream *)lua_touserdata(L, -2))->queue = q, q->running++;
+      lua_pop(L, 3); // proc, nil, args
+      continue;
+    }
+    lua_rawgeti(L, args, 3);
+    lua_rawgeti(L, args, lua_istable(L, -1) ? 6 : 5); // exit_cb
+    lua_replace(L, -2);
+    if (lua_isfunction(L, -1)) {
+      lua_pushinteger(L, -1), lua_pushvalue(L, -3);
+      if (lua_pcall(L, 2, 0, 0) != LUA_OK)
+        fprintf(stderr, "Lua: %s\n", lua_tostring(L, -1)), lua_pop(L, 1);
+    } else lua_pop(L, 1); // non-function
+    lua_pop(L, 3); // nil, error, args
+  }
+  if (!q->running && !q->njobs)
+    luaL_unref(L, LUA_REGISTRYINDEX, q->ref), q->ref = LUA_NOREF;
+}
+
+/**
+ * Calls the exit callback of process *p* with exit status *status*, closes the
+ * process' fds, and releases its Lua references.
+ */
+static void p_exited(PStream *p, int status) {
+  lua_State *L = p->L;
+  if (events) p_trace(p, p_now(), 'i', "exit", status);
+  for (int err = 0; err < 2; err++)
+    if (p_beginoutput(p, err)) p_endoutput(p, err, 1); // pass last lines
+  if (p->exit_cb != LUA_REFNIL) {
+    int nargs = 1;
+    lua_pushinteger(L, status);
+#if (!GTK || __APPLE__)
+    if (p->hasrusage) l_pushrusage(L, p), nargs++;
+#endif
+    p_callback(p, p->exit_cb, nargs);
+  }
+  if (p->queue) p->queue->running--, q_next(L, p->queue), p->queue = NULL;
+#if !_WIN32
+  if (p->yield) {
+    // Resume any coroutine waiting for the rest of stdout or for the exit.
+    p->throttled = 0, p_buffer(p), p->eof = 1, p_wakereader(p);
+    if (p->co) p_resume(p, (lua_pushboolean(p->co, 1), 1));
+  }
+#endif
+#if _WIN32
+  close(p->pid);
+#endif
+#if (!GTK || __APPLE__)
+#if __linux__
+  if (epfd >= 0) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->fstdout, NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->fstderr, NULL);
+    if (p->fexit >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, p->fexit, NULL);
+  }
+#endif
+  if (p->fexit >= 0) close(p->fexit);
+  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref), lua_pushnil(L);
+  lua_rawset(L, -3); // spawn_procs[proc] = nil
+  lua_pop(L, 1); // spawn_procs
+#endif
+#if (GTK && !__APPLE__)
+  if (p->dwatch) g_source_remove(p->dwatch), p->dwatch = 0;
+  // Output fds are about to be closed, so stop monitoring them.
+  for (int err = 0; err < 2; err++)
+    if (p->cwatch[err]) g_source_remove(p->cwatch[err]), p->cwatch[err] = 0;
+#else
+  if (p->dlindex >= 0) dl_set(p, 0), dl_arm();
+#endif
+#if !_WIN32
+#if (GTK && !__APPLE__)
+  if (p->wwatch) g_source_remove(p->wwatch), p->wwatch = 0;
+#elif __linux__
+  if (epfd >= 0 && p->wqueue) epoll_ctl(epfd, EPOLL_CTL_DEL, p->fstdin, NULL);
+#endif
+  p_dropqueue(p);
+  if (p->fstdin >= 0) close(p->fstdin);
+#else
+  close(p->fstdin);
+#endif
+  close(p->fstdout), close(p->fstderr);
+  luaL_unref(L, LUA_REGISTRYINDEX, p->stdout_cb);
+  luaL_unref(L, LUA_REGISTRYINDEX, p->stderr_cb);
+  luaL_unref(L, LUA_REGISTRYINDEX, p->exit_cb);
+  luaL_unref(L, LUA_REGISTRYINDEX, p->drain_cb);
+  luaL_unref(L, LUA_REGISTRYINDEX, p->ref); // allow proc to be collected
+  p->pid = 0;
+}
+
+/** __gc Lua metamethod. */
+static int lp_gc(lua_State *L) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+#if (GTK && !__APPLE__)
+  if (p->pid) {
+    // lua_close() was called, forcing GC. Disconnect listeners since GTK is
+    // still running and may try to invoke callbacks.
+    // Disconnect cstdout, cstderr, stdin, and child watches.
+    while (g_source_remove_by_user_data(p)) ;
+  } else
+    for (int err = 0; err < 2; err++)
+      if (p->cwatch[err]) g_source_remove(p->cwatch[err]); // not yet hung up
+#if _WIN32
+  if (p->cstdout) g_io_channel_unref(p->cstdout);
+  if (p->cstderr) g_io_channel_unref(p->cstderr);
+#endif
+#else
+  if (p->dlindex >= 0) dl_set(p, 0), dl_arm(); // lua_close() was called
+  if (p->reader) {
+    // Its reader frees itself once it reaches EOF, so let it.
+    Reader *r = p->reader;
+    r->p = NULL;
+    __atomic_store_n(&r->paused[0], 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->paused[1], 0, __ATOMIC_SEQ_CST), bg_nudge();
+  }
+  free(p->pids);
+#endif
+  free(p->buf);
+#if !_WIN32
+  free(p->rbuf);
+  p_dropqueue(p);
+#endif
+  free(p->partial[0].s), free(p->partial[1].s);
+  free(p->filter[0].s), free(p->filter[1].s);
+  free(p->capture[0].s), free(p->capture[1].s);
+  return 0;
+}
+
+#if !_WIN32
+/**
+ * Signal that fd *fd* of process *p* has output to read.
+ * Output is read into a per-process buffer that starts at `BUFSIZ` bytes and
+ * doubles (up to `MAX_RBUFSIZ`) whenever a read fills it, so a process that
+ * writes a lot of output is read in fewer, larger blocks.
+ */
+static void fd_read(int fd, PStream *p) {
+  if (fd == p->fstdout && p->yield) {
+    p_buffer(p); // for proc:read() instead of callbacks
+    return;
+  }
+  if (!p->rbuf && (p->rbuf = malloc(BUFSIZ))) p->rbufsize = BUFSIZ;
+  if (!p->rbuf) return;
+  ssize_t len;
+  int err = fd != p->fstdout, batch = p_beginoutput(p, err);
+  if (!err && p->bufpos < p->buflen) {
+    // Pass along stdout buffered, but not consumed, by proc:read().
+    p_output(p, 0, p->buf + p->bufpos, p->buflen - p->bufpos);
+    p->bufpos = p->buflen = 0;
+  }
+  // Only read while data is available, since stdout and stderr block.
+  struct pollfd pfd = {fd, POLLIN, 0};
+  while (poll(&pfd, 1, 0) > 0) {
+    size_t size = p->rbufsize;
+    p_countread(p, err, len = read(fd, p->rbuf, size));
+    if (len > 0) p_output(p, err, p->rbuf, len);
+    if (len < (ssize_t)size) break;
+    char *rbuf = (size < MAX_RBUFSIZ) ? realloc(p->rbuf, 2 * size) : NULL;
+    if (rbuf) p->rbuf = rbuf, p->rbufsize = 2 * size;
+  }
+  if (batch) p_endoutput(p, err, 0);
+}
+#endif
+
+#if (GTK && !__APPLE__)
+#if _WIN32
+/** Signal that channel output is available for reading. */
+static int ch_read(GIOChannel *source, GIOCondition cond, void *data) {
+  PStream *p = (PStream *)data;
+  int err = source != p->cstdout, watch = FALSE;
+  if (p->pid && !err && p->yield)
+    watch = (p_buffer(p), !p->eof); // for proc:read() instead of callbacks
+  else if (p->pid && (cond & G_IO_IN)) {
+    char buf[BUFSIZ];
+    size_t len = 0;
+    int batch = p_beginoutput(p, err);
+    do {
+      int status = g_io_channel_read_chars(source, buf, BUFSIZ, &len, NULL);
+      p_countread(p, err, len);
+      if (status == G_IO_STATUS_NORMAL && len > 0) p_output(p, err, buf, len);
+    } while (len == BUFSIZ);
+    if (batch) p_endoutput(p, err, 0);
+    watch = p->pid && !(cond & G_IO_HUP);
+  }
+  if (!watch) p->cwatch[err] = 0, p->hups |= 1 << err; // never watch it again
+  return watch;
+}
+#else
+/** Signal that fd *fd* of process *p* has output to read or has hung up. */
+static int fd_ready(int fd, GIOCondition cond, void *data) {
+  PStream *p = (PStream *)data;
+  int err = fd != p->fstdout, watch = FALSE;
+  if (p->pid && !err && p->yield)
+    watch = (fd_read(fd, p), !p->eof); // read until EOF for proc:read()
+  else if (p->pid && (cond & G_IO_IN))
+    watch = (fd_read(fd, p), p->pid && !(cond & G_IO_HUP));
+  if (!watch) p->cwatch[err] = 0, p->hups |= 1 << err; // never watch it again
+  return watch;
+}
+#endif
+
+/**
+ * Signal that process *p*'s deadline has passed.
+ * Sends it its deadline signal, and if that is not SIGKILL, schedules SIGKILL
+ * once its grace period is over.
+ */
+static int p_deadline(void *data) {
+  PStream *p = (PStream *)data;
+  if (events) p_trace(p, p_now(), 'i', "deadline", p->dsignal);
+  p_kill(p, p->dsignal), p->dwatch = 0;
+  if (p->dsignal != SIGKILL) {
+    p->dsignal = SIGKILL;
+    p->dwatch = g_timeout_add(p->grace * 1000, p_deadline, p);
+  }
+  return FALSE;
+}
+
+/** Starts process *p*'s deadline. */
+static void p_startdeadline(PStream *p) {
+  p->dwatch = g_timeout_add(p->timeout * 1000, p_deadline, p);
+}
+
+/**
+ * Returns whether or not process *p*'s stdout (or stderr if *err* is non-zero)
+ * must be watched for output, which is the case when it is passed to a Lua
+ * callback, captured, or buffered for a coroutine.
+ */
+static int p_watched(PStream *p, int err) {
+  if (!err && p->yield) return 1; // buffered for proc:read()
+  return (!err ? p->stdout_cb : p->stderr_cb) > 0 || p->capture[err].size;
+}
+
+#if _WIN32
+/**
+ * Creates a new channel for reading output from a file descriptor, which
+ * `p_watch()` monitors.
+ * @param fd File descriptor returned by `_open_osfhandle()`.
+ * The channel is released when its process is collected.
+ */
+static GIOChannel *new_channel(int fd) {
+  GIOChannel *channel = g_io_channel_unix_new(fd);
+  g_io_channel_set_encoding(channel, NULL, NULL);
+  g_io_channel_set_buffered(channel, FALSE);
+  return channel;
+}
+#endif
+
+/** Signal that the child process finished. */
+static void p_exit(GPid pid, int status, void *data) {
+  PStream *p = (PStream *)data;
+#if !_WIN32
+  fd_read(p->fstdout, p), fd_read(p->fstderr, p); // read anything left
+#endif
+  p_exited(p, status);
+  (void)pid; // UNUSED
+}
+#elif !_WIN32
+/**
+ * Pushes onto the stack an fd_set of all spawned processes for use with
+ * `select()` and `lspawn_readfds()` and returns the `nfds` to pass to
+ * `select()`.
+ */
+int lspawn_pushfds(lua_State *L) {
+  int nfds = 1;
+  fd_set *fds = (fd_set *)lua_newuserdata(L, sizeof(fd_set));
+  FD_ZERO(fds);
+  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    PStream *p = (PStream *)lua_touserdata(L, -2);
+    // Fds beyond FD_SETSIZE cannot be selected; use lspawn_epollfd() instead.
+    for (int err = 0; err < 2 && !p->reader; err++) {
+      int fd = !err ? p->fstdout : p->fstderr;
+      if (!p_reading(p, err) || fd >= FD_SETSIZE) continue;
+      FD_SET(fd, fds);
+      if (fd >= nfds) nfds = fd + 1;
+    }
+    for (int i = -1; i < p->npids; i++) {
+      int fd = (i < 0) ? p->fexit : p->pidfds[i];
+      if (fd < 0 || fd >= FD_SETSIZE) continue;
+      FD_SET(fd, fds);
+      if (fd >= nfds) nfds = fd + 1;
+    }
+    lua_pop(L, 1); // value
+  }
+  lua_pop(L, 1); // spawn_procs
+  if (tfd >= 0 && tfd < FD_SETSIZE) {
+    FD_SET(tfd, fds);
+    if (tfd >= nfds) nfds = tfd + 1;
+  }
+  if (qfd[0] >= 0 && qfd[0] < FD_SETSIZE) {
+    FD_SET(qfd[0], fds);
+    if (qfd[0] >= nfds) nfds = qfd[0] + 1;
+  }
+  return nfds;
+}
+
+/**
+ * Returns whether or not process *p* may have finished according to the fd_set
+ * *fds*, which is the case when the set includes a ready exit fd, or when *p*
+ * has an exit fd that could not be selected or no exit fd at all.
+ */
+static int p_mayhaveexited(PStream *p, fd_set *fds) {
+  if (p->reaped) return 0; // waiting for its background reader instead
+  if (!p->npids)
+    return p->fexit < 0 || p->fexit >= FD_SETSIZE || FD_ISSET(p->fexit, fds);
+  for (int i = 0; i < p->npids; i++)
+    if (p->statuses[i] == -1 && (p->pidfds[i] < 0 ||
+        p->pidfds[i] >= FD_SETSIZE || FD_ISSET(p->pidfds[i], fds)))
+      return 1;
+  return 0;
+}
+
+/**
+ * Returns whether or not process *p* has output to read or may have finished,
+ * according to fd_set *fds*.
+ */
+static int p_readready(PStream *p, fd_set *fds) {
+  return (p->fstdout < FD_SETSIZE && FD_ISSET(p->fstdout, fds)) ||
+         (p->fstderr < FD_SETSIZE && FD_ISSET(p->fstderr, fds)) ||
+         p_mayhaveexited(p, fds);
+}
+
+/**
+ * Returns whether or not process *p* has queued input it can write, according
+ * to fd_set *fds*.
+ */
+static int p_writeready(PStream *p, fd_set *fds) {
+  return p->wqueue && p->fstdin < FD_SETSIZE && FD_ISSET(p->fstdin, fds);
+}
+
+/**
+ * Pushes onto the stack a list of the spawned processes for which *ready*
+ * returns non-zero given fd_set *fds*, and returns its length.
+ * Processes are handled from this list rather than while traversing
+ * `spawn_procs`, since Lua callbacks may spawn processes, and adding keys to a
+ * table during traversal is undefined. The list also keeps its processes alive
+ * until handled.
+ */
+static int p_pushready(lua_State *L, fd_set *fds,
+                       int (*ready)(PStream *, fd_set *)) {
+  int len = 0;
+  lua_newtable(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    lua_pop(L, 1); // value
+    if (!ready((PStream *)lua_touserdata(L, -1), fds)) continue;
+    lua_pushvalue(L, -1), lua_rawseti(L, -4, ++len);
+  }
+  lua_pop(L, 1); // spawn_procs
+  return len;
+}
+
+/**
+ * Signals that process *p* has finished with exit status *status* and cleans up
+ * after it, unless its output is still being read in the background, in which
+ * case this happens once that reader finishes.
+ */
+static void p_finished(PStream *p, int status) {
+  if (p->reader) {
+    p->reaped = 1, p->status = status;
+    // A reaped process' exit fd stays ready forever, so stop monitoring it.
+#if __linux__
+    if (epfd >= 0 && p->fexit >= 0)
+      epoll_ctl(epfd, EPOLL_CTL_DEL, p->fexit, NULL);
+#endif
+    if (p->fexit >= 0) close(p->fexit), p->fexit = -1;
+    return;
+  }
+  fd_read(p->fstdout, p), fd_read(p->fstderr, p); // read anything left
+  p_exited(p, status);
+}
+
+/**
+ * Passes output queued by the background thread to the appropriate Lua
+ * callbacks (or to `proc:read()`), and signals processes whose readers have
+ * finished if they have too. Consecutive output from the same stream is passed
+ * as a single batch.
+ * Returns the number of blocks of output read.
+ */
+static int bg_drain(lua_State *L) {
+  int n = 0, top = lua_gettop(L), err = 0, batch = 0;
+  char buf[8];
+  while (read(qfd[0], buf, sizeof(buf)) > 0) ;
+  __atomic_store_n(&qsignaled, 0, __ATOMIC_RELEASE);
+  PStream *p = NULL; // process whose output batch is open, if any
+  for (Msg *m; (m = q_get()); free(m)) {
+    Reader *r = m->r;
+    size_t queued = __atomic_sub_fetch(&r->queued, m->len, __ATOMIC_SEQ_CST);
+    if (r->high && queued <= r->low &&
+        __atomic_exchange_n(&r->stalled, 0, __ATOMIC_SEQ_CST))
+      bg_nudge(); // resume reading
+    if (batch && (r->p != p || m->err != err)) p_endoutput(p, err, 0), batch = 0;
+    if (!(p = r->p)) {
+      // The process was collected, so discard its output.
+      if (m->err == 2) close(r->fds[0]), close(r->fds[1]), free(r);
+      continue;
+    }
+    if ((err = m->err) < 2) {
+      p_countread(p, err, m->len), n++;
+      if (!err && p->yield) {
+        if (p_reserve(p, m->len) == 0)
+          memcpy(p->buf + p->buflen, m->data, m->len), p->buflen += m->len;
+        p_wakereader(p), p_throttle(p); // for proc:read() instead of callbacks
+        continue;
+      }
+      if (!batch) batch = p_beginoutput(p, err);
+      p_output(p, err, m->data, m->len);
+      continue;
+    }
+    // The reader has finished, so stdout and stderr are at EOF.
+    p->reader = NULL, free(r);
+    if (p->yield) p->eof = 1, p_wakereader(p);
+    // Without exit fds, the process is exiting, but may not be reapable yet,
+    // and no other event will signal it.
+    int status, noexitfd = p->fexit < 0 && !(p->npids && p->pidfds[0] >= 0);
+    if (p->reaped) status = p->status;
+    else if (!p->pid || !noexitfd || !p_reap(p, &status, 0)) continue;
+    // Keep proc alive until the end of this batch, which may refer to it.
+    luaL_checkstack(L, 1, NULL);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+    p_exited(p, status);
+  }
+  if (batch) p_endoutput(p, err, 0);
+  lua_settop(L, top);
+  return n;
+}
+
+/**
+ * Reads any output from the fds in the fd_set at the top of the stack and
+ * returns the number of fds read from.
+ * Also signals any registered child processes that have finished and cleans up
+ * after them.
+ */
+int lspawn_readfds(lua_State *L) {
+  int n = 0;
+  if (events) p_trace(NULL, p_now(), 'B', "readfds", 0);
+  if (ndeadlines) dl_expire();
+  fd_set *fds = (fd_set *)lua_touserdata(L, -1);
+  if (qfd[0] >= 0 && qfd[0] < FD_SETSIZE && FD_ISSET(qfd[0], fds))
+    n += bg_drain(L);
+  int len = p_pushready(L, fds, p_readready);
+  for (int i = 1; i <= len; i++) {
+    lua_rawgeti(L, -1, i);
+    PStream *p = (PStream *)lua_touserdata(L, -1);
+    lua_pop(L, 1); // proc, which the list keeps alive
+    if (!p->pid) continue; // finished earlier in this pass
+    // Read output if any is available.
+    if (p->fstdout < FD_SETSIZE && FD_ISSET(p->fstdout, fds))
+      fd_read(p->fstdout, p), n++;
+    if (p->fstderr < FD_SETSIZE && FD_ISSET(p->fstderr, fds))
+      fd_read(p->fstderr, p), n++;
+    // Check process status, but only if it may have changed.
+    int status;
+    if (p->pid && p_mayhaveexited(p, fds) && p_reap(p, &status, WNOHANG))
+      p_finished(p, status);
+  }
+  lua_pop(L, 1); // list
+  if (events) p_trace(NULL, p_now(), 'E', "readfds", n);
+  return n;
+}
+
+/**
+ * Pushes onto the stack an fd_set of the stdin fds of spawned processes that
+ * have input queued by `proc:write()`, for use as the *writefds* of `select()`
+ * and with `lspawn_writefds()`, and returns the `nfds` to pass to `select()`.
+ */
+int lspawn_pushwritefds(lua_State *L) {
+  int nfds = 1;
+  fd_set *fds = (fd_set *)lua_newuserdata(L, sizeof(fd_set));
+  FD_ZERO(fds);
+  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    PStream *p = (PStream *)lua_touserdata(L, -2);
+    if (p->wqueue && p->fstdin < FD_SETSIZE) {
+      FD_SET(p->fstdin, fds);
+      if (p->fstdin >= nfds) nfds = p->fstdin + 1;
+    }
+    lua_pop(L, 1); // value
+  }
+  lua_pop(L, 1); // spawn_procs
+  return nfds;
+}
+
+/**
+ * Writes queued input to the fds in the fd_set at the top of the stack and
+ * returns the number of fds written to.
+ */
+int lspawn_writefds(lua_State *L) {
+  int n = 0;
+  fd_set *fds = (fd_set *)lua_touserdata(L, -1);
+  int len = p_pushready(L, fds, p_writeready);
+  for (int i = 1; i <= len; i++) {
+    lua_rawgeti(L, -1, i);
+    PStream *p = (PStream *)lua_touserdata(L, -1);
+    lua_pop(L, 1); // proc, which the list keeps alive
+    if (p->pid && p->wqueue) p_flush(p), n++;
+  }
+  lua_pop(L, 1); // list
+  return n;
+}
+
+#if __linux__
+/**
+ * Returns an epoll fd that becomes readable when any spawned process has output
+ * to read, has finished, or can accept queued input, for use with
+ * `lspawn_dispatch()`.
+ * The epoll instance is created on first call, after which `spawn()` registers
+ * each new process' fds with it exactly once. The returned fd may itself be
+ * monitored by `select()`, `poll()`, or another epoll instance.
+ */
+int lspawn_epollfd(lua_State *L) {
+  if (epfd >= 0) return epfd;
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+  if (tfd >= 0) ev_add(NULL, tfd, EV_TIMER);
+  if (qfd[0] >= 0) ev_add(NULL, qfd[0], EV_QUEUE);
+  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    ev_watch((PStream *)lua_touserdata(L, -2));
+    lua_pop(L, 1); // value
+  }
+  lua_pop(L, 1); // spawn_procs
+  return epfd;
+}
+
+/**
+ * Waits up to *timeout* milliseconds (-1 for indefinitely, 0 to not block) for
+ * events on the fd returned by `lspawn_epollfd()`, reads output from and writes
+ * queued input to the fds that are ready, and returns the number of fds read
+ * from.
+ * Also signals any ready child processes that have finished and cleans up after
+ * them. Unlike `lspawn_readfds()`, only processes with pending events are
+ * visited.
+ */
+int lspawn_dispatch(lua_State *L, int timeout) {
+  struct epoll_event ready[64];
+  int n = 0, top = lua_gettop(L);
+  if (lspawn_epollfd(L) < 0) return -1;
+  int nev = epoll_wait(epfd, ready, 64, timeout);
+  if (events && nev > 0) p_trace(NULL, p_now(), 'B', "dispatch", 0);
+  // Keep each ready process alive until the end of this batch, which refers to
+  // it, even if a Lua callback finishes it first.
+  if (tfd < 0 && ndeadlines) dl_expire(); // without a timer to signal them
+  luaL_checkstack(L, nev, NULL);
+  for (int i = 0; i < nev; i++) {
+    PStream *p = ev_proc(ready[i]);
+    if (p) lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+  }
+  for (int i = 0; i < nev; i++) {
+    int kind = ready[i].data.u64 & EV_MASK;
+    if (kind == EV_TIMER) {
+      dl_expire();
+      continue;
+    } else if (kind == EV_QUEUE) {
+      n += bg_drain(L);
+      continue;
+    }
+    PStream *p = ev_proc(ready[i]);
+    if (!p->pid) continue; // finished earlier in this batch
+    if (kind == EV_STDIN) {
+      p_flush(p);
+      continue;
+    }
+    if (kind != EV_EXIT) {
+      int fd = (kind == EV_STDOUT) ? p->fstdout : p->fstderr;
+      if (ready[i].events & EPOLLIN) fd_read(fd, p), n++;
+      if (!(ready[i].events & (EPOLLHUP | EPOLLERR))) continue;
+      // A hung up fd stays ready forever, so stop monitoring it.
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL), p->hups |= 1 << kind;
+      if (p->fexit >= 0 || (p->npids && p->pidfds[0] >= 0))
+        continue; // wait for the exit event instead
+    }
+    // Without exit fds, a process whose stdout and stderr have both hung up is
+    // exiting, but may not be reapable yet, and no further events will arrive.
+    int status, options = (kind != EV_EXIT && p->hups == 3) ? 0 : WNOHANG;
+    if (p_reap(p, &status, options)) p_finished(p, status);
+  }
+  if (events && nev > 0) p_trace(NULL, p_now(), 'E', "dispatch", n);
+  lua_settop(L, top);
+  return n;
+}
+#endif
+
+#if (GTK && __APPLE__)
+static int monitoring_fds = 0;
+/**
+ * Monitors spawned fds when GTK is idle.
+ * This is necessary because at the moment, using GLib on Mac OSX to spawn
+ * and monitor file descriptors will abort when attempting to poll those fds.
+ */
+static int monitor_fds(void *data) {
+  lua_State *L = (lua_State *)data;
+  struct timeval timeout = {0, 1e5}; // 0.1s
+  int nfds = lspawn_pushfds(L), wnfds = lspawn_pushwritefds(L);
+  fd_set *fds = (fd_set *)lua_touserdata(L, -2);
+  fd_set *wfds = (fd_set *)lua_touserdata(L, -1);
+  if (select(nfds > wnfds ? nfds : wnfds, fds, wfds, NULL, &timeout) > 0) {
+    lspawn_writefds(L), lua_pop(L, 1); // wfds
+    lspawn_readfds(L);
+  } else lua_pop(L, 1); // wfds
+  lua_pop(L, 1); // fds
+  if (nfds == 1) monitoring_fds = 0;
+  return nfds > 1;
+}
+#endif
+#endif
+
+/**
+ * Starts or stops monitoring process *p*'s stdout (or stderr if *err* is
+ * non-zero) for output depending on whether or not it is paused, so a paused
+ * process eventually blocks writing to a full pipe.
+ * Under `select()`, `lspawn_pushfds()` leaves out paused fds instead.
+ */
+static void p_watch(PStream *p, int err) {
+  int reading = p_reading(p, err);
+#if (GTK && !__APPLE__)
+  if (reading && !p->cwatch[err] && !(p->hups & (1 << err)) && p->pid &&
+      p_watched(p, err))
+#if _WIN32
+    p->cwatch[err] = g_io_add_watch(!err ? p->cstdout : p->cstderr,
+                                    G_IO_IN | G_IO_HUP, ch_read, p);
+#else
+    p->cwatch[err] = g_unix_fd_add(!err ? p->fstdout : p->fstderr,
+                                   G_IO_IN | G_IO_HUP, fd_ready, p);
+#endif
+  else if (!reading && p->cwatch[err])
+    g_source_remove(p->cwatch[err]), p->cwatch[err] = 0;
+#else
+  if (p->reader) {
+    __atomic_store_n(&p->reader->paused[err], !reading, __ATOMIC_SEQ_CST);
+    if (reading) bg_nudge();
+    return;
+  }
+#if __linux__
+  if (epfd < 0 || !p->pid || (p->hups & (1 << err))) return;
+  int fd = !err ? p->fstdout : p->fstderr;
+  if (reading)
+    ev_add(p, fd, !err ? EV_STDOUT : EV_STDERR);
+  else
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+#endif
+}
+
+/**
+ * Pauses (if *paused* is non-zero) or resumes reading the output of the process
+ * at index 1 of *L*, from the stream named at index 2, or from both.
+ */
+static int p_pause(lua_State *L, int paused) {
+  PStream *p = (PStream *)luaL_checkudata(L, 1, "ta_spawn");
+  luaL_argcheck(L, p->pid, 1, "process terminated");
+  static const char *const streams[] = {"stdout", "stderr", NULL};
+  int stream = lua_isnoneornil(L, 2) ? -1 : luaL_checkoption(L, 2, NULL, streams);
+  for (int err = 0; err < 2; err++)
+    if ((stream < 0 || err == stream) && p->paused[err] != paused)
+      p->paused[err] = paused, p_watch(p, err);
+  return 0;
+}
+
+/** p:pause() Lua function. */
+static int lp_pause(lua_State *L) { return p_pause(L, 1); }
+
+/** p:resume() Lua function. */
+static int lp_resume(lua_State *L) { return p_pause(L, 0); }
+
+#if (!GTK || __APPLE__)
+/**
+ * Splits command line *cmd* into arguments separated by spaces, where a
+ * double-quoted argument may contain spaces, and returns the number of
+ * arguments.
+ * If *argv* is non-NULL, it receives the arguments, which are copied into *s*.
+ */
+static int p_split(const char *cmd, char **argv, char *s) {
+  int argc = 0;
+  for (const char *c = cmd, *param; *c;) {
+    while (*c == ' ') c++;
+    if (!*c) break;
+    param = c;
+    if (*c == '"') {
+      param = ++c;
+      while (*c && *c != '"') c++;
+    } else while (*c && *c != ' ') c++;
+    if (argv)
+      argv[argc] = memcpy(s, param, c - param), s += c - param, *s++ = '\0';
+    argc++;
+    if (*c == '"') c++;
+  }
+  return argc;
+}
+
+/**
+ * Returns command line *cmd* as a NULL-terminated list of arguments in a single
+ * block of memory to be freed with `free()`, or NULL if memory is exhausted.
+ */
+static char **p_argv(const char *cmd) {
+  int argc = p_split(cmd, NULL, NULL);
+  char **argv = malloc((argc + 1) * sizeof(char *) + strlen(cmd) + 1);
+  if (!argv) return NULL;
+  p_split(cmd, argv, (char *)(argv + argc + 1)), argv[argc] = NULL;
+  return argv;
+}
+#endif
+
+#if !_WIN32
+/**
+ * Returns the list of 'KEY=VALUE' strings in the table at index *index* as a
+ * NULL-terminated environment in a single block of memory to be freed with
+ * `free()`, or NULL if memory is exhausted.
+ */
+static char **p_envp(lua_State *L, int index) {
+  int envn = lua_rawlen(L, index);
+  size_t size = (envn + 1) * sizeof(char *);
+  for (int i = 0; i < envn; i++)
+    lua_rawgeti(L, index, i + 1), size += lua_rawlen(L, -1) + 1, lua_pop(L, 1);
+  char **envp = malloc(size), *s = (char *)(envp + envn + 1);
+  if (!envp) return NULL;
+  for (int i = 0; i < envn; i++) {
+    lua_rawgeti(L, index, i + 1);
+    size_t len = lua_rawlen(L, -1);
+    envp[i] = memcpy(s, lua_tostring(L, -1), len), s += len, *s++ = '\0';
+    lua_pop(L, 1); // pair
+  }
+  envp[envn] = NULL;
+  return envp;
+}
+#endif
+
+/**
+ * Pushes onto the stack a new, not yet running, process with the Lua callbacks
+ * at stack indices *cb* (stdout), *cb* + 1 (stderr), and *cb* + 2 (exit), and
+ * options in the table (or nil) at index *opts*, and returns that process.
+ */
+static PStream *p_new(lua_State *L, int cb, int opts) {
+  PStream *p = (PStream *)lua_newuserdata(L, sizeof(PStream));
+#if LUA_VERSION_NUM >= 502
+  // Callbacks and resumed coroutines must not run on a coroutine that spawned
+  // the process, which may be suspended or dead by then.
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  p->L = lua_tothread(L, -1), lua_pop(L, 1);
+#else
+  p->L = L;
+#endif
+  p->ref = 0, p->pid = 0;
+#if (!GTK || __APPLE__)
+  p->fexit = -1, p->npids = 0, p->pids = p->statuses = p->pidfds = NULL;
+  p->served = 0, p->pty = 0;
+  l_getoption(L, opts, "background"), p->background = lua_toboolean(L, -1);
+  lua_pop(L, 1); // background
+  p->reader = NULL, p->reaped = 0, p->status = 0;
+  memset(&p->rusage, 0, sizeof(struct rusage)), p->hasrusage = 0;
+#endif
+  p->buf = NULL, p->bufpos = p->buflen = p->bufsize = 0, p->eof = 0;
+  p->hups = 0, p->paused[0] = p->paused[1] = 0, p->throttled = 0;
+  l_getoption(L, opts, "watermark");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "high"), p->high = lua_tointeger(L, -1);
+    lua_getfield(L, -2, "low"), p->low = lua_tointeger(L, -1);
+    lua_pop(L, 2); // high, low
+  } else p->high = lua_tointeger(L, -1), p->low = p->high / 2;
+  lua_pop(L, 1); // watermark
+  if (p->low > p->high) p->low = p->high;
+#if !_WIN32
+  p->wqueue = p->wtail = NULL, p->wqueued = 0, p->wclose = 0;
+#if (GTK && !__APPLE__)
+  p->wwatch = 0;
+#endif
+#endif
+#if (GTK && !__APPLE__)
+#if _WIN32
+  p->cstdout = p->cstderr = NULL;
+#endif
+  p->cwatch[0] = p->cwatch[1] = 0;
+#endif
+#if !_WIN32
+  p->rbuf = NULL, p->rbufsize = 0;
+#endif
+  p->stdout_cb = l_reffunction(L, cb);
+  p->stderr_cb = l_reffunction(L, cb + 1);
+  p->exit_cb = l_reffunction(L, cb + 2);
+  p->drain_cb = LUA_REFNIL;
+  l_getoption(L, opts, "lines"), p->lines = lua_toboolean(L, -1);
+  lua_pop(L, 1); // lines
+  memset(p->partial, 0, sizeof(p->partial));
+  memset(p->filter, 0, sizeof(p->filter));
+  l_getoption(L, opts, "filter");
+  for (int err = 0; err < 2; err++) {
+    // A single pattern filters both streams.
+    if (lua_istable(L, -1)) lua_getfield(L, -1, !err ? "stdout" : "stderr");
+    else lua_pushvalue(L, -1);
+    size_t len;
+    const char *pattern = lua_isstring(L, -1) ? lua_tolstring(L, -1, &len) :
+                                                NULL;
+    if (pattern) f_compile(&p->filter[err], pattern, len);
+    lua_pop(L, 1); // pattern
+  }
+  lua_pop(L, 1); // filter
+  memset(p->capture, 0, sizeof(p->capture));
+  memset(&p->stats, 0, sizeof(Stats)), p->stats.first_byte = -1;
+  p->started = p_now();
+  l_getoption(L, opts, "capture");
+  lua_Integer capture = lua_tointeger(L, -1); // bytes kept per stream
+  lua_pop(L, 1); // capture
+  for (int err = 0; err < 2 && capture > 0; err++)
+    if ((p->capture[err].s = malloc(capture))) p->capture[err].size = capture;
+  l_getoption(L, opts, "timeout"), p->timeout = lua_tonumber(L, -1);
+  l_getoption(L, opts, "grace");
+  p->grace = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 5;
+  l_getoption(L, opts, "signal");
+  p->dsignal = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : SIGTERM;
+  lua_pop(L, 3); // timeout, grace, signal
+#if (GTK && !__APPLE__)
+  p->dwatch = p->cowatch = 0;
+#else
+  p->dkill = p->wakeup = 0, p->dlindex = -1;
+#endif
+  p->queue = NULL;
+#if !_WIN32
+  l_getoption(L, opts, "yield"), p->yield = lua_toboolean(L, -1);
+  lua_pop(L, 1); // yield
+#else
+  p->yield = 0;
+#endif
+  p->co = NULL, p->coref = LUA_NOREF, p->comode = 0, p->cobytes = 0;
+  if (luaL_newmetatable(L, "ta_spawn")) {
+    l_setcfunction(L, -1, "status", lp_status);
+    l_setcfunction(L, -1, "wait", lp_wait);
+    l_setcfunction(L, -1, "read", lp_read);
+    l_setcfunction(L, -1, "write", lp_write);
+    l_setcfunction(L, -1, "writefile", lp_writefile);
+    l_setcfunction(L, -1, "pending", lp_pending);
+    l_setcfunction(L, -1, "ondrain", lp_ondrain);
+    l_setcfunction(L, -1, "close", lp_close);
+    l_setcfunction(L, -1, "kill", lp_kill);
+    l_setcfunction(L, -1, "pause", lp_pause);
+    l_setcfunction(L, -1, "resume", lp_resume);
+#if (!GTK || __APPLE__)
+    l_setcfunction(L, -1, "resize", lp_resize);
+#endif
+    l_setcfunction(L, -1, "statuses", lp_statuses);
+    l_setcfunction(L, -1, "output", lp_output);
+    l_setcfunction(L, -1, "stats", lp_stats);
+    l_setcfunction(L, -1, "rusage", lp_rusage);
+    l_setcfunction(L, -1, "__tostring", lp_tostring);
+    l_setcfunction(L, -1, "__gc", lp_gc);
+    lua_pushvalue(L, -1), lua_setfield(L, -2, "__index");
+  }
+  lua_setmetatable(L, -2);
+  return p;
+}
+
+#if (!GTK || __APPLE__)
+/**
+ * Registers running process *p*, which is at the top of the stack of *L*, for
+ * monitoring its fds and pid.
+ */
+static void p_register(lua_State *L, PStream *p) {
+  fcntl(p->fstdin, F_SETFL, O_NONBLOCK); // proc:write() must never block
+#if __linux__
+  // Exit fds are -1 before Linux 5.3.
+  if (!p->npids && !p->served) p->fexit = syscall(SYS_pidfd_open, p->pid, 0);
+  for (int i = 0; i < p->npids; i++)
+    p->pidfds[i] = syscall(SYS_pidfd_open, p->pids[i], 0);
+#endif
+  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
+  // spawn_procs is of the form: t[proc] = true
+  lua_pushvalue(L, -2), lua_pushboolean(L, 1), lua_settable(L, -3);
+  lua_pop(L, 1); // spawn_procs
+  if (p->background) bg_watch(p);
+#if __linux__
+  if (epfd >= 0) ev_watch(p);
+#endif
+#if (GTK && __APPLE__)
+  // On GTK-OSX, manually monitoring spawned fds prevents the fd polling
+  // aborts caused by GLib.
+  if (!monitoring_fds) g_idle_add(monitor_fds, p->L), monitoring_fds = 1;
+#endif
+}
+#endif
+
+/**
+ * Finishes starting process *p*, which `spawn()` or `spawn.pipeline()` just
+ * pushed onto the stack below its error message (nil on success).
+ */
+static void p_started(lua_State *L, PStream *p) {
+  if (!lua_isuserdata(L, -2)) return;
+  p->ref = (lua_pushvalue(L, -2), luaL_ref(L, LUA_REGISTRYINDEX));
+  p->stats.spawn_time = p_now() - p->started;
+  totals.spawn_time += p->stats.spawn_time, nspawned++;
+  p_trace(p, p->started, 'B', "spawn", 0);
+  p_trace(p, p->started + p->stats.spawn_time, 'E', "spawn", 0);
+  if (p->timeout > 0) p_startdeadline(p);
 }
 
+#if !_WIN32
 /**
- * Reads any output from the fds in the fd_set at the top of the stack and
- * returns the number of fds read from.
- * Also signals any registered child processes that have finished and cleans up
- * after them.
+ * Spawns a process for `spawn()` or `cmd:run()`, pushes it (or nil) and nil (or
+ * an error message) onto the stack, and returns 2.
+ * @param file Optional program to execute instead of searching `PATH` for
+ *   `argv[0]`. May be `NULL`.
+ * @param argv NULL-terminated list of program name and arguments.
+ * @param cwd Optional working directory for the child. May be `NULL`.
+ * @param envp Optional NULL-terminated environment for the child. May be
+ *   `NULL`.
+ * @param cb Stack index of the stdout callback, followed by the stderr and exit
+ *   callbacks.
+ * @param opts Stack index of the table of options, or nil.
+ * @param cmd Command line for error messages.
  */
-int lspawn_readfds(lua_State *L) {
-  int n = 0;
-  fd_set *fds = (fd_set *)lua_touserdata(L, -1);
-  lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
-  lua_pushnil(L);
-  while (lua_next(L, -2)) {
-    PStream *p = (PStream *)lua_touserdata(L, -2);
-    // Read output if any is available.
-    if (FD_ISSET(p->fstdout, fds)) fd_read(p->fstdout, p), n++;
-    if (FD_ISSET(p->fstderr, fds)) fd_read(p->fstderr, p), n++;
-    // Check process status.
-    int status;
-    if (waitpid(p->pid, &status, WNOHANG) > 0) {
-      fd_read(p->fstdout, p), fd_read(p->fstderr, p); // read anything left
-      if (p->exit_cb != LUA_REFNIL) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, p->exit_cb);
-        lua_pushinteger(L, status);
-        if (lua_pcall(L, 1, 0, 0) != LUA_OK)
-          fprintf(stderr, "Lua: %s\n", lua_tostring(L, -1)), lua_pop(L, 1);
-      }
-      close(p->fstdin), close(p->fstdout), close(p->fstderr);
-      luaL_unref(L, LUA_REGISTRYINDEX, p->stdout_cb);
-      luaL_unref(L, LUA_REGISTRYINDEX, p->stderr_cb);
-      luaL_unref(L, LUA_REGISTRYINDEX, p->exit_cb);
-      luaL_unref(L, LUA_REGISTRYINDEX, p->ref); // allow proc to be collected
-      p->pid = 0;
-      lua_pushnil(L), lua_replace(L, -2), lua_settable(L, -3); // t[proc] = nil
-      lua_pushnil(L); // push nil for next call to lua_next()
-    } else lua_pop(L, 1); // value
+static int p_start(lua_State *L, const char *file, char **argv,
+                   const char *cwd, char **envp, int cb, int opts,
+                   const char *cmd) {
+  l_getoption(L, opts, "stdin");
+  int fin = !lua_isnil(L, -1) ? p_openstdin(L, -1) : -2; // -2 for a pipe
+  if (fin == -1) {
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", lua_tostring(L, -2),
+                                    strerror(errno));
+    return 2;
   }
-  lua_pop(L, 1); // spawn_procs
-  return n;
+  lua_pop(L, 1); // stdin
+
+  PStream *p = p_new(L, cb, opts);
+
+#if (GTK && !__APPLE__)
+  GSpawnFlags flags = G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH;
+  int argc = 0;
+  while (argv[argc]) argc++;
+  char *args[file ? argc + 2 : 1]; // file followed by argv
+  if (file) {
+    flags = G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_FILE_AND_ARGV_ZERO;
+    args[0] = (char *)file, memcpy(args + 1, argv, (argc + 1) * sizeof(char *));
+    argv = args;
+  }
+  GError *error = NULL;
+#if GLIB_CHECK_VERSION(2, 68, 0)
+  p->fstdin = -1;
+  if (g_spawn_async_with_pipes_and_fds(cwd, (const char *const *)argv,
+                                       (const char *const *)envp, flags, NULL,
+                                       NULL, fin, -1, -1, NULL, NULL, 0,
+                                       &p->pid, (fin < 0) ? &p->fstdin : NULL,
+                                       &p->fstdout, &p->fstderr, &error)) {
+    if (p->fstdin >= 0) fcntl(p->fstdin, F_SETFL, O_NONBLOCK);
+#else
+  if (g_spawn_async_with_pipes(cwd, argv, envp, flags, NULL, NULL, &p->pid,
+                               &p->fstdin, &p->fstdout, &p->fstderr, &error)) {
+    fcntl(p->fstdin, F_SETFL, O_NONBLOCK); // proc:write() must never block
+    // Without a way to connect the stdin file directly, feed it instead.
+    if (fin >= 0 && (p_writefile(p, fin), p->wqueue)) p->wclose = 1;
+    else if (fin >= 0) close(p->fstdin), p->fstdin = -1;
+#endif
+    p_watch(p, 0), p_watch(p, 1);
+    g_child_watch_add_full(G_PRIORITY_DEFAULT + 1, p->pid, p_exit, p, NULL);
+    lua_pushnil(L); // no error
+  } else {
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", cmd, error->message);
+    g_error_free(error);
+  }
+#else
+  l_getoption(L, opts, "pty");
+  int pty = lua_toboolean(L, -1), cols = 80, rows = 24, raw = 0;
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "cols"), lua_getfield(L, -2, "rows");
+    lua_getfield(L, -3, "raw"), raw = lua_toboolean(L, -1);
+    if (lua_tointeger(L, -3) > 0) cols = lua_tointeger(L, -3);
+    if (lua_tointeger(L, -2) > 0) rows = lua_tointeger(L, -2);
+    lua_pop(L, 3); // cols, rows, raw
+  }
+  lua_pop(L, 1); // pty
+  // Attempt to create pipes for stdin, stdout, and stderr and spawn process.
+  // A pseudo-terminal takes the place of the stdin and stdout pipes, and a
+  // stdin file is connected directly instead.
+  int pstdin[2] = {-1, -1}, pstdout[2] = {-1, -1}, pstderr[2] = {-1, -1}, pid;
+  int ok = pty ? p_openpty(pstdin, pstdout, cols, rows, raw) == 0 :
+                 (fin >= 0 || p_pipe(pstdin) == 0) && p_pipe(pstdout) == 0;
+  if (ok && pty && fin >= 0)
+    close(pstdin[0]), close(pstdin[1]), pstdin[0] = pstdin[1] = -1;
+  if (ok && p_pipe(pstderr) == 0 &&
+      (pid = sv_spawn(file ? file : argv[0], argv, cwd, envp,
+                      (int[]){(fin >= 0) ? fin : pstdin[0], pstdout[1],
+                              pstderr[1]},
+                      &p->fexit)) > 0) {
+    if (pstdin[0] >= 0) close(pstdin[0]);
+    close(pstdout[1]), close(pstderr[1]);
+    p->pid = pid, p->served = p->fexit >= 0, p->pty = pty;
+    p->fstdin = pstdin[1], p->fstdout = pstdout[0], p->fstderr = pstderr[0];
+    p_register(L, p);
+    lua_pushnil(L); // no error
+  } else {
+    int error = errno;
+    if (pstdin[0] >= 0) close(pstdin[0]), close(pstdin[1]);
+    if (pstdout[0] >= 0) close(pstdout[0]), close(pstdout[1]);
+    if (pstderr[0] >= 0) close(pstderr[0]), close(pstderr[1]);
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", cmd, strerror(error));
+  }
+#endif
+  if (fin >= 0) close(fin);
+  return (p_started(L, p), 2);
 }
+#endif
 
-#if (GTK && __APPLE__)
-static int monitoring_fds = 0;
+#if (GTK && !__APPLE__)
 /**
- * Monitors spawned fds when GTK is idle.
- * This is necessary because at the moment, using GLib on Mac OSX to spawn
- * and monitor file descriptors will abort when attempting to poll those fds.
+ * Raises an error for options in the table at index *opts* that only lspawn's
+ * own event loop supports, rather than ignoring them.
  */
-static int monitor_fds(void *data) {
-  lua_State *L = (lua_State *)data;
-  struct timeval timeout = {0, 1e5}; // 0.1s
-  int nfds = lspawn_pushfds(L);
-  fd_set *fds = (fd_set *)lua_touserdata(L, -1);
-  if (select(nfds, fds, NULL, NULL, &timeout) > 0) lspawn_readfds(L);
-  lua_pop(L, 1); // fd_set
-  if (nfds == 1) monitoring_fds = 0;
-  return nfds > 1;
+static void p_checkoptions(lua_State *L, int opts) {
+  const char *options[] = {"pty", "background"};
+  for (int i = 0; i < 2; i++) {
+    l_getoption(L, opts, options[i]);
+    if (lua_toboolean(L, -1))
+      luaL_error(L, "%s option not implemented in this environment",
+                 options[i]);
+    lua_pop(L, 1); // option
+  }
 }
 #endif
-#endif
 
 /** spawn() Lua function. */
 static int spawn(lua_State *L) {
 #if !_WIN32
 #if (GTK && !__APPLE__)
+  p_checkoptions(L, lua_istable(L, 3) ? 7 : 6);
   char **argv = NULL;
   GError *error = NULL;
   if (!g_shell_parse_argv(luaL_checkstring(L, 1), NULL, &argv, &error)) {
@@ -367,46 +3065,21 @@ static int spawn(lua_State *L) {
     luaL_argerror(L, 1, lua_tostring(L, -1));
   }
 #else
-  lua_newtable(L);
-  const char *param = luaL_checkstring(L, 1), *c = param;
-  while (*c) {
-    while (*c == ' ') c++;
-    param = c;
-    if (*c == '"') {
-      param = ++c;
-      while (*c && *c != '"') c++;
-    } else while (*c && *c != ' ') c++;
-    lua_pushlstring(L, param, c - param);
-    lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
-    if (*c == '"') c++;
-  }
-  int argc = lua_rawlen(L, -1);
-  char **argv = malloc((argc + 1) * sizeof(char *));
-  for (int i = 0; i < argc; i++) {
-    lua_rawgeti(L, -1, i + 1);
-    size_t len = lua_rawlen(L, -1);
-    char *param = malloc(len + 1);
-    strcpy(param, lua_tostring(L, -1)), param[len] = '\0';
-    argv[i] = param;
-    lua_pop(L, 1); // param
-  }
-  argv[argc] = NULL;
-  lua_pop(L, 1); // argv
+  char **argv = p_argv(luaL_checkstring(L, 1));
 #endif
-  int envn = 0;
-  char **envp = NULL;
-  if (lua_istable(L, 3)) {
-    envn = lua_rawlen(L, 3), envp = malloc((envn + 1) * sizeof(char *));
-    for (int i = 0; i < envn; i++) {
-      lua_rawgeti(L, 3, i + 1);
-      size_t len = lua_rawlen(L, -1);
-      char *pair = malloc(len + 1);
-      strcpy(pair, lua_tostring(L, -1)), pair[len] = '\0';
-      envp[i] = pair;
-      lua_pop(L, 1); // pair
-    }
-    envp[envn] = NULL;
-  }
+  char **envp = lua_istable(L, 3) ? p_envp(L, 3) : NULL;
+  int opts = !envp ? 6 : 7; // optional table of options after the callbacks
+  luaL_argcheck(L, lua_istable(L, opts) || lua_isnoneornil(L, opts), opts,
+                "table or nil expected");
+  lua_settop(L, 7); // ensure 7 values so userdata to be pushed is 8th
+  int n = p_start(L, NULL, argv, lua_tostring(L, 2), envp, !envp ? 3 : 4, opts,
+                  lua_tostring(L, 1));
+#if (GTK && !__APPLE__)
+  g_strfreev(argv);
+#else
+  free(argv);
+#endif
+  return (free(envp), n);
 #else
   lua_pushstring(L, getenv("COMSPEC"));
   lua_pushstring(L, " /c ");
@@ -433,105 +3106,13 @@ static int spawn(lua_State *L) {
     memcpy(envp, lua_tostring(L, -1), lua_rawlen(L, -1));
     lua_pop(L, 1); // buf
   }
-#endif
-  lua_settop(L, 6); // ensure 6 values so userdata to be pushed is 7th
-
-  PStream *p = (PStream *)lua_newuserdata(L, sizeof(PStream));
-  p->L = L, p->ref = 0;
-  p->stdout_cb = l_reffunction(L, !envp ? 3 : 4);
-  p->stderr_cb = l_reffunction(L, !envp ? 4 : 5);
-  p->exit_cb = l_reffunction(L, !envp ? 5 : 6);
-  if (luaL_newmetatable(L, "ta_spawn")) {
-    l_setcfunction(L, -1, "status", lp_status);
-    l_setcfunction(L, -1, "wait", lp_wait);
-    l_setcfunction(L, -1, "read", lp_read);
-    l_setcfunction(L, -1, "write", lp_write);
-    l_setcfunction(L, -1, "close", lp_close);
-    l_setcfunction(L, -1, "kill", lp_kill);
-    l_setcfunction(L, -1, "__tostring", lp_tostring);
-#if (GTK && !__APPLE__)
-    l_setcfunction(L, -1, "__gc", lp_gc);
-#endif
-    lua_pushvalue(L, -1), lua_setfield(L, -2, "__index");
-  }
-  lua_setmetatable(L, -2);
+  int opts = !envp ? 6 : 7; // optional table of options after the callbacks
+  luaL_argcheck(L, lua_istable(L, opts) || lua_isnoneornil(L, opts), opts,
+                "table or nil expected");
+  lua_settop(L, 7); // ensure 7 values so userdata to be pushed is 8th
 
-#if !_WIN32
-#if (GTK && !__APPLE__)
-  GSpawnFlags flags = G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH;
-  if (g_spawn_async_with_pipes(lua_tostring(L, 2), argv, envp, flags, NULL,
-                               NULL, &p->pid, &p->fstdin, &p->fstdout,
-                               &p->fstderr, &error)) {
-    p->cstdout = new_channel(p->fstdout, p, p->stdout_cb > 0);
-    p->cstderr = new_channel(p->fstderr, p, p->stderr_cb > 0);
-    g_child_watch_add_full(G_PRIORITY_DEFAULT + 1, p->pid, p_exit, p, NULL);
-    lua_pushnil(L); // no error
-  } else {
-    lua_pushnil(L);
-    lua_pushfstring(L, "%s: %s", lua_tostring(L, 1), error->message);
-  }
+  PStream *p = p_new(L, !envp ? 3 : 4, opts);
 
-  g_strfreev(argv);
-#else
-  // Adapted from Chris Emerson and GLib.
-  // Attempt to create pipes for stdin, stdout, and stderr and fork process.
-  int pstdin[2] = {-1, -1}, pstdout[2] = {-1, -1}, pstderr[2] = {-1, -1}, pid;
-  if (pipe(pstdin) == 0 && pipe(pstdout) == 0 && pipe(pstderr) == 0 &&
-      (pid = fork()) >= 0) {
-    if (pid > 0) {
-      // Parent process: register child for monitoring its fds and pid.
-      close(pstdin[0]), close(pstdout[1]), close(pstderr[1]);
-      p->pid = pid;
-      p->fstdin = pstdin[1], p->fstdout = pstdout[0], p->fstderr = pstderr[0];
-      lua_getfield(L, LUA_REGISTRYINDEX, "spawn_procs");
-      // spawn_procs is of the form: t[proc] = true
-      lua_pushvalue(L, -2), lua_pushboolean(L, 1), lua_settable(L, -3);
-      lua_pop(L, 1); // spawn_procs
-      lua_pushnil(L); // no error
-#if (GTK && __APPLE__)
-      // On GTK-OSX, manually monitoring spawned fds prevents the fd polling
-      // aborts caused by GLib.
-      if (!monitoring_fds) g_idle_add(monitor_fds, L), monitoring_fds = 1;
-#endif
-    } else if (pid == 0) {
-      // Child process: redirect stdin, stdout, and stderr, chdir, and exec.
-      close(pstdin[1]), close(pstdout[0]), close(pstderr[0]);
-      close(0), close(1), close(2);
-      dup2(pstdin[0], 0), dup2(pstdout[1], 1), dup2(pstderr[1], 2);
-      close(pstdin[0]), close(pstdout[1]), close(pstderr[1]);
-      const char *cwd = lua_tostring(L, 2);
-      if (cwd && chdir(cwd) < 0) {
-        fprintf(stderr, "Failed to change directory '%s' (%s)", cwd,
-                strerror(errno));
-        exit(EXIT_FAILURE);
-      }
-      extern char **environ;
-#if __linux__
-      if (!envp) envp = environ;
-      execvpe(argv[0], argv, envp); // does not return on success
-#else
-      if (envp) environ = envp;
-      execvp(argv[0], argv); // does not return on success
-#endif
-      fprintf(stderr, "Failed to execute child process \"%s\" (%s)", argv[0],
-              strerror(errno));
-      exit(EXIT_FAILURE);
-    }
-  } else {
-    if (pstdin[0] >= 0) close(pstdin[0]), close(pstdin[1]);
-    if (pstdout[0] >= 0) close(pstdout[0]), close(pstdout[1]);
-    if (pstderr[0] >= 0) close(pstderr[0]), close(pstderr[1]);
-    lua_pushnil(L);
-    lua_pushfstring(L, "%s: %s", lua_tostring(L, 1), strerror(errno));
-  }
-  for (int i = 0; i < argc; i++) free(argv[i]);
-  free(argv);
-  if (envp) {
-    for (int i = 0; i < envn; i++) free(envp[i]);
-    free(envp);
-  }
-#endif
-#else
 #if GTK
   // Adapted from SciTE.
   SECURITY_DESCRIPTOR sd;
@@ -567,8 +3148,9 @@ static int spawn(lua_State *L) {
                      envp, *cwd ? cwd : NULL, &startup_info, &proc_info)) {
     p->pid = proc_info.hProcess;
     p->fstdin = proc_stdin, p->fstdout = proc_stdout, p->fstderr = proc_stderr;
-    p->cstdout = new_channel(FD(proc_stdout), p, p->stdout_cb > 0);
-    p->cstderr = new_channel(FD(proc_stderr), p, p->stderr_cb > 0);
+    p->cstdout = new_channel(FD(proc_stdout));
+    p->cstderr = new_channel(FD(proc_stderr));
+    p_watch(p, 0), p_watch(p, 1);
     g_child_watch_add(p->pid, p_exit, p);
     // Close unneeded handles.
     CloseHandle(proc_info.hThread);
@@ -589,20 +3171,525 @@ static int spawn(lua_State *L) {
 #else
   luaL_error(L, "not implemented in this environment");
 #endif
+  return (p_started(L, p), 2);
 #endif
-  if (lua_isuserdata(L, -2))
-    p->ref = (lua_pushvalue(L, -2), luaL_ref(L, LUA_REGISTRYINDEX));
+}
 
-  return 2;
+/** spawn.pipeline() Lua function. */
+static int pipeline(lua_State *L) {
+#if (!GTK || __APPLE__)
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int n = lua_rawlen(L, 1);
+  luaL_argcheck(L, n > 0, 1, "non-empty table expected");
+  for (int i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    luaL_argcheck(L, lua_isstring(L, -1), 1, "table of strings expected");
+    lua_pop(L, 1); // command
+  }
+  const char *cwd = luaL_optstring(L, 2, NULL);
+  int opts = !lua_istable(L, 3) ? 6 : 7; // optional table after the callbacks
+  luaL_argcheck(L, lua_istable(L, opts) || lua_isnoneornil(L, opts), opts,
+                "table or nil expected");
+  lua_settop(L, 7); // ensure 7 values so userdata to be pushed is 8th
+  l_getoption(L, opts, "stdin");
+  int fin = !lua_isnil(L, -1) ? p_openstdin(L, -1) : -2; // -2 for a pipe
+  if (fin == -1) {
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", lua_tostring(L, -2),
+                                    strerror(errno));
+    return 2;
+  }
+  lua_pop(L, 1); // stdin
+
+  PStream *p = p_new(L, opts - 3, opts);
+  char **envp = lua_istable(L, 3) ? p_envp(L, 3) : NULL;
+  if ((p->pids = malloc(3 * n * sizeof(int))))
+    p->statuses = p->pids + n, p->pidfds = p->pids + 2 * n;
+  // Create pipes for the first stage's stdin, the last stage's stdout, and all
+  // stages' stderr, connect each stage's stdout directly to the next stage's
+  // stdin, and spawn each stage. A stdin file takes the place of the first
+  // stage's stdin pipe.
+  int pstdin[2] = {(fin >= 0) ? fin : -1, -1}, pstdout[2] = {-1, -1};
+  int pstderr[2] = {-1, -1};
+  int i = 0, in = -1, error = ENOMEM;
+  if (p->pids && (fin >= 0 || p_pipe(pstdin) == 0) && p_pipe(pstdout) == 0 &&
+      p_pipe(pstderr) == 0) {
+    for (in = pstdin[0]; i < n; i++) {
+      int link[2] = {-1, pstdout[1]}; // the last stage writes to pstdout
+      if (i < n - 1 && p_pipe(link) < 0) {
+        error = errno;
+        break;
+      }
+      lua_rawgeti(L, 1, i + 1);
+      char **argv = p_argv(lua_tostring(L, -1));
+      lua_pop(L, 1); // command
+      p->statuses[i] = -1, p->pidfds[i] = -1;
+      p->pids[i] = argv ?
+        p_spawn(argv[0], argv, cwd, envp, (int[]){in, link[1], pstderr[1]}) :
+        (errno = ENOMEM, -1);
+      error = errno, free(argv);
+      if (in != pstdin[0]) close(in);
+      if (i < n - 1) close(link[1]);
+      in = link[0];
+      if (p->pids[i] < 0) break;
+    }
+  } else if (p->pids) error = errno;
+  if (i == n) {
+    close(pstdin[0]), close(pstdout[1]), close(pstderr[1]);
+    p->npids = n, p->pid = p->pids[n - 1];
+    p->fstdin = pstdin[1], p->fstdout = pstdout[0], p->fstderr = pstderr[0];
+    p_register(L, p);
+    lua_pushnil(L); // no error
+  } else {
+    // Stop any stages already running.
+    for (int j = 0; j < i; j++) kill(p->pids[j], SIGKILL);
+    for (int j = 0; j < i; j++) waitpid(p->pids[j], NULL, 0);
+    if (in >= 0 && in != pstdin[0]) close(in);
+    if (pstdin[0] >= 0) close(pstdin[0]);
+    if (pstdin[1] >= 0) close(pstdin[1]);
+    if (pstdout[0] >= 0) close(pstdout[0]), close(pstdout[1]);
+    if (pstderr[0] >= 0) close(pstderr[0]), close(pstderr[1]);
+    lua_pushnil(L);
+    lua_rawgeti(L, 1, i + 1);
+    lua_pushfstring(L, "%s: %s", lua_tostring(L, -1), strerror(error));
+    lua_replace(L, -2); // command
+  }
+  free(envp);
+  return (p_started(L, p), 2);
+#else
+  return luaL_error(L, "not implemented in this environment");
+#endif
 }
 
-int luaopen_spawn(lua_State *L) {
-#if LUA_VERSION_NUM < 502
-  lua_register(L, "spawn", spawn);
+#if !_WIN32
+/**
+ * A command line prepared once for spawning repeatedly. Its argv, envp, cwd,
+ * and command line are all in the single block of memory *argv* points to.
+ */
+typedef struct {
+  char **argv, **envp; // envp is NULL to inherit the parent's environment
+  const char *cwd, *cmd; // cwd is NULL to inherit the parent's cwd
+  char *file; // cached full path of the program, or NULL to search PATH
+  char *path; // value of PATH when file was cached ("" if unset), or NULL
+} Command;
+
+/**
+ * Copies NULL-terminated list of strings *strs* to the list *list*, and the
+ * strings themselves to **s*, advancing it.
+ */
+static void c_copy(char **list, char **strs, char **s) {
+  for (; *strs; strs++, list++) {
+    size_t len = strlen(*strs) + 1;
+    *list = memcpy(*s, *strs, len), *s += len;
+  }
+  *list = NULL;
+}
+
+/**
+ * Returns the full path of program *name*, searching `PATH` like `execvp()`,
+ * as a string to be freed with `free()`, or NULL if it was not found.
+ */
+static char *c_which(const char *name) {
+  const char *path = getenv("PATH");
+  if (!path) path = "/bin:/usr/bin";
+  for (const char *dir = path, *end;; dir = end + 1) {
+    if (!(end = strchr(dir, ':'))) end = dir + strlen(dir);
+    size_t len = (end > dir) ? end - dir : 1; // an empty entry means "."
+    char *file = malloc(len + strlen(name) + 2);
+    if (!file) return NULL;
+    memcpy(file, (end > dir) ? dir : ".", len), file[len] = '/';
+    strcpy(file + len + 1, name);
+    struct stat st;
+    if (stat(file, &st) == 0 && S_ISREG(st.st_mode) && access(file, X_OK) == 0)
+      return file;
+    free(file);
+    if (!*end) return NULL;
+  }
+}
+
+/**
+ * Returns the program command *c* executes, resolving and caching its full
+ * path if necessary, or NULL to have `PATH` searched for it.
+ * The cached path is resolved again whenever `PATH` changes.
+ */
+static const char *c_file(Command *c) {
+  if (strchr(c->argv[0], '/')) return NULL; // no search needed
+  const char *path = getenv("PATH");
+  if (!path) path = "";
+  if (c->path && strcmp(c->path, path) == 0) return c->file;
+  free(c->file), free(c->path), c->file = c_which(c->argv[0]);
+  if ((c->path = malloc(strlen(path) + 1))) strcpy(c->path, path);
+  return c->file;
+}
+
+/** cmd:run() Lua function. */
+static int lc_run(lua_State *L) {
+  Command *c = (Command *)luaL_checkudata(L, 1, "ta_spawn_command");
+  luaL_argcheck(L, lua_istable(L, 5) || lua_isnoneornil(L, 5), 5,
+                "table or nil expected");
+  lua_settop(L, 5);
+#if (GTK && !__APPLE__)
+  p_checkoptions(L, 5);
+#endif
+  int n = p_start(L, c_file(c), c->argv, c->cwd, c->envp, 2, 5, c->cmd);
+  // The cached program may have been removed since.
+  if (!lua_isuserdata(L, -2)) free(c->path), c->path = NULL;
+  return n;
+}
+
+/** tostring(cmd) Lua function. */
+static int lc_tostring(lua_State *L) {
+  Command *c = (Command *)luaL_checkudata(L, 1, "ta_spawn_command");
+  return (lua_pushfstring(L, "command (%s)", c->cmd), 1);
+}
+
+/** __gc Lua metamethod. */
+static int lc_gc(lua_State *L) {
+  Command *c = (Command *)luaL_checkudata(L, 1, "ta_spawn_command");
+  return (free(c->argv), free(c->file), free(c->path), 0);
+}
+
+/** spawn.command() Lua function. */
+static int command(lua_State *L) {
+  const char *cmd = luaL_checkstring(L, 1), *cwd = luaL_optstring(L, 2, NULL);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+#if (GTK && !__APPLE__)
+  char **argv = NULL;
+  GError *error = NULL;
+  if (!g_shell_parse_argv(cmd, NULL, &argv, &error)) {
+    lua_pushfstring(L, "invalid argv: %s", error->message);
+    luaL_argerror(L, 1, lua_tostring(L, -1));
+  }
+#else
+  char **argv = p_argv(cmd);
+#endif
+  char **envp = lua_istable(L, 3) ? p_envp(L, 3) : NULL;
+  // Lay out argv, envp, cwd, and cmd in a single block.
+  int argc = 0, envc = 0;
+  size_t size = strlen(cmd) + 1 + (cwd ? strlen(cwd) + 1 : 0);
+  for (; argv && argv[argc]; argc++) size += strlen(argv[argc]) + 1;
+  for (; envp && envp[envc]; envc++) size += strlen(envp[envc]) + 1;
+  size += (argc + 1 + (envp ? envc + 1 : 0)) * sizeof(char *);
+  Command *c = (Command *)lua_newuserdata(L, sizeof(Command));
+  memset(c, 0, sizeof(Command));
+  if (luaL_newmetatable(L, "ta_spawn_command")) {
+    l_setcfunction(L, -1, "run", lc_run);
+    l_setcfunction(L, -1, "__tostring", lc_tostring);
+    l_setcfunction(L, -1, "__gc", lc_gc);
+    lua_pushvalue(L, -1), lua_setfield(L, -2, "__index");
+  }
+  lua_setmetatable(L, -2);
+  char *s = (argv && (!lua_istable(L, 3) || envp)) ? malloc(size) : NULL;
+  if (s) {
+    c->argv = (char **)s, s += (argc + 1) * sizeof(char *);
+    if (envp) c->envp = (char **)s, s += (envc + 1) * sizeof(char *);
+    c_copy(c->argv, argv, &s);
+    if (envp) c_copy(c->envp, envp, &s);
+    if (cwd) c->cwd = strcpy(s, cwd), s += strlen(cwd) + 1;
+    c->cmd = strcpy(s, cmd);
+  }
+#if (GTK && !__APPLE__)
+  g_strfreev(argv);
+#else
+  free(argv);
+#endif
+  free(envp);
+  if (!c->argv) return luaL_error(L, "out of memory");
+  luaL_argcheck(L, argc > 0, 1, "empty command");
+  return 1;
+}
+#endif
+
+#if !_WIN32
+/** spawn.run() Lua function. */
+static int run(lua_State *L) {
+  Command *c = (Command *)luaL_testudata(L, 1, "ta_spawn_command");
+  const char *cmd = c ? c->cmd : luaL_checkstring(L, 1);
+  luaL_argcheck(L, lua_istable(L, 2) || lua_isnoneornil(L, 2), 2,
+                "table or nil expected");
+  lua_settop(L, 2);
+  l_getoption(L, 2, "cwd"), l_getoption(L, 2, "env");
+  l_getoption(L, 2, "input"), l_getoption(L, 2, "timeout");
+  const char *cwd = lua_isstring(L, 3) ? lua_tostring(L, 3) : c ? c->cwd : NULL;
+  size_t inlen = 0;
+  const char *input = lua_isstring(L, 5) ? lua_tolstring(L, 5, &inlen) : NULL;
+  double timeout = lua_tonumber(L, 6);
+#if (GTK && !__APPLE__)
+  char **argv = c ? c->argv : NULL;
+  GError *gerror = NULL;
+  if (!c && !g_shell_parse_argv(cmd, NULL, &argv, &gerror)) {
+    lua_pushfstring(L, "invalid argv: %s", gerror->message);
+    luaL_argerror(L, 1, lua_tostring(L, -1));
+  }
+#define run_freeargv(argv) g_strfreev(argv)
+#else
+  char **argv = c ? c->argv : p_argv(cmd);
+#define run_freeargv(argv) free(argv)
+#endif
+  char **envp = lua_istable(L, 4) ? p_envp(L, 4) : c ? c->envp : NULL;
+  if (!argv || !argv[0] || (lua_istable(L, 4) && !envp)) {
+    int empty = argv && !argv[0];
+    if (!c) run_freeargv(argv);
+    if (envp && envp != (c ? c->envp : NULL)) free(envp);
+    return !empty ? luaL_error(L, "out of memory") :
+                    luaL_argerror(L, 1, "empty command");
+  }
+
+  // Spawn the process with pipes for stdin, stdout, and stderr.
+  int pstdin[2] = {-1, -1}, pstdout[2] = {-1, -1}, pstderr[2] = {-1, -1};
+  int fexit = -1;
+  pid_t pid = -1;
+  if (p_pipe(pstdin) == 0 && p_pipe(pstdout) == 0 && p_pipe(pstderr) == 0) {
+    const char *file = c ? c_file(c) : NULL;
+    pid = sv_spawn(file ? file : argv[0], argv, cwd, envp,
+                   (int[]){pstdin[0], pstdout[1], pstderr[1]}, &fexit);
+  }
+  int error = errno, served = fexit >= 0;
+  if (!c) run_freeargv(argv);
+#undef run_freeargv
+  if (envp && envp != (c ? c->envp : NULL)) free(envp);
+  int *fds[] = {&pstdin[0], &pstdout[1], &pstderr[1], // the child's ends
+                &pstdin[1], &pstdout[0], &pstderr[0]};
+  for (int i = 0; i < ((pid < 0) ? 6 : 3); i++)
+    if (*fds[i] >= 0) close(*fds[i]), *fds[i] = -1;
+  if (pid < 0) {
+    if (c) free(c->path), c->path = NULL; // the cached program may be gone
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", cmd, strerror(error));
+    return 2;
+  }
+#if __linux__
+  // A pidfd lets poll() notice the process finishing while its output is open.
+  if (fexit < 0) fexit = syscall(SYS_pidfd_open, pid, 0);
+#endif
+  if (inlen) fcntl(pstdin[1], F_SETFL, O_NONBLOCK);
+  else close(pstdin[1]), pstdin[1] = -1;
+
+  // Write input and read output until both stdout and stderr end and the
+  // process finishes, or until the deadline passes, at which point the process
+  // is killed and any remaining output is discarded.
+  Buf out[2] = {{NULL, 0, 0}, {NULL, 0, 0}};
+  double deadline = (timeout > 0) ? p_now() + timeout : 0;
+  int status = -1, exited = 0, nomem = 0, timedout = 0;
+  size_t written = 0;
+  while (pstdout[0] >= 0 || pstderr[0] >= 0 || !exited) {
+    if (deadline && p_now() >= deadline) {
+      if (!exited) kill(pid, SIGKILL);
+      deadline = 0, timedout = !nomem;
+      for (int i = 3; i < 6; i++)
+        if (*fds[i] >= 0) close(*fds[i]), *fds[i] = -1;
+    }
+    if (pstdout[0] < 0 && pstderr[0] < 0 && fexit < 0) {
+      // Without an fd to poll for the process finishing, wait for it directly,
+      // checking periodically if there is a deadline.
+      if (waitpid(pid, &status, deadline ? WNOHANG : 0) != 0) break;
+      poll(NULL, 0, 10);
+      continue;
+    }
+    int ms = -1;
+    if (deadline) ms = (int)((deadline - p_now()) * 1000) + 1;
+    struct pollfd pfds[4] = {{pstdin[1], POLLOUT, 0}, {pstdout[0], POLLIN, 0},
+                             {pstderr[0], POLLIN, 0}, {fexit, POLLIN, 0}};
+    if (poll(pfds, 4, ms) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (pfds[0].revents) {
+      struct iovec iov = {(char *)input + written, inlen - written};
+      ssize_t n = p_writev(pstdin[1], &iov, 1);
+      if (n > 0) written += n;
+      if (written == inlen || (n < 0 && errno != EAGAIN && errno != EINTR))
+        close(pstdin[1]), pstdin[1] = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+      int *fd = !i ? &pstdout[0] : &pstderr[0];
+      if (!pfds[i + 1].revents) continue;
+      if (buf_reserve(&out[i], BUFSIZ) < 0) {
+        nomem = 1, deadline = p_now(); // kill the process and stop
+        break;
+      }
+      ssize_t n = read(*fd, out[i].s + out[i].len, out[i].size - out[i].len);
+      if (n > 0) out[i].len += n;
+      else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        close(*fd), *fd = -1;
+    }
+    if (pfds[3].revents) {
+      if (served) {
+        // The spawn server writes the exit status, or exits and closes the
+        // pipe.
+        Exit e;
+        ssize_t n = read(fexit, &e, sizeof(Exit));
+        if (n == sizeof(Exit)) status = e.status;
+        exited = n >= 0;
+      } else exited = waitpid(pid, &status, WNOHANG) != 0;
+      if (exited) close(fexit), fexit = -1;
+    }
+  }
+  if (pstdin[1] >= 0) close(pstdin[1]);
+  if (fexit >= 0) close(fexit);
+  if (!nomem) {
+    lua_pushlstring(L, out[0].s ? out[0].s : "", out[0].len);
+    lua_pushlstring(L, out[1].s ? out[1].s : "", out[1].len);
+    lua_pushinteger(L, status), lua_pushboolean(L, timedout);
+  }
+  free(out[0].s), free(out[1].s);
+  return !nomem ? 4 : luaL_error(L, "out of memory");
+}
+#endif
+
+/** spawn.stats() Lua function. */
+static int stats(lua_State *L) {
+  return (l_pushstats(L, &totals, 1), 1);
+}
+
+/** q:spawn() Lua function. */
+static int lq_spawn(lua_State *L) {
+  Queue *q = (Queue *)luaL_checkudata(L, 1, "ta_spawn_queue");
+  luaL_checkstring(L, 2);
+  int n = lua_gettop(L) - 1, opts = lua_istable(L, 4) ? 8 : 7;
+  luaL_argcheck(L, lua_istable(L, opts) || lua_isnoneornil(L, opts), opts,
+                "table or nil expected");
+  if (q->running < q->limit && !q->njobs) {
+    lua_pushcfunction(L, spawn), lua_insert(L, 2);
+    lua_call(L, n, 2);
+    if (lua_isuserdata(L, -2)) {
+      ((PStream *)lua_touserdata(L, -2))->queue = q, q->running++;
+      if (q->ref == LUA_NOREF)
+        q->ref = (lua_pushvalue(L, 1), luaL_ref(L, LUA_REGISTRYINDEX));
+    }
+    return 2;
+  }
+  l_getoption(L, opts, "priority");
+  Job job = {0, lua_tonumber(L, -1), q->seq++};
+  lua_pop(L, 1); // priority
+  lua_createtable(L, n, 1);
+  for (int i = 1; i <= n; i++) lua_pushvalue(L, i + 1), lua_rawseti(L, -2, i);
+  lua_pushinteger(L, n), lua_setfield(L, -2, "n");
+  job.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (q_push(q, job) < 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, job.ref);
+    return luaL_error(L, "out of memory");
+  }
+  if (q->ref == LUA_NOREF)
+    q->ref = (lua_pushvalue(L, 1), luaL_ref(L, LUA_REGISTRYINDEX));
+  return (lua_pushboolean(L, 0), 1);
+}
+
+/** q:pending() Lua function. */
+static int lq_pending(lua_State *L) {
+  Queue *q = (Queue *)luaL_checkudata(L, 1, "ta_spawn_queue");
+  return (lua_pushinteger(L, q->njobs), 1);
+}
+
+/** q:running() Lua function. */
+static int lq_running(lua_State *L) {
+  Queue *q = (Queue *)luaL_checkudata(L, 1, "ta_spawn_queue");
+  return (lua_pushinteger(L, q->running), 1);
+}
+
+/** __gc Lua metamethod. */
+static int lq_gc(lua_State *L) {
+  Queue *q = (Queue *)luaL_checkudata(L, 1, "ta_spawn_queue");
+  return (free(q->jobs), 0); // only collected with no jobs, or by lua_close()
+}
+
+/** Returns the number of processors online. */
+static int p_ncpus(void) {
+#if GTK
+  return g_get_num_processors();
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? n : 1;
+#else
+  return 1;
 #endif
+}
+
+/** spawn.queue() Lua function. */
+static int queue(lua_State *L) {
+  int limit = luaL_optinteger(L, 1, p_ncpus());
+  luaL_argcheck(L, limit > 0, 1, "positive number expected");
+  Queue *q = (Queue *)lua_newuserdata(L, sizeof(Queue));
+  memset(q, 0, sizeof(Queue)), q->limit = limit, q->ref = LUA_NOREF;
+  if (luaL_newmetatable(L, "ta_spawn_queue")) {
+    l_setcfunction(L, -1, "spawn", lq_spawn);
+    l_setcfunction(L, -1, "pending", lq_pending);
+    l_setcfunction(L, -1, "running", lq_running);
+    l_setcfunction(L, -1, "__gc", lq_gc);
+    lua_pushvalue(L, -1), lua_setfield(L, -2, "__index");
+  }
+  return (lua_setmetatable(L, -2), 1);
+}
+
+/** spawn.trace() Lua function. */
+static int trace(lua_State *L) {
+  size_t n = luaL_optinteger(L, 1, 0);
+  free(events), events = NULL, nevents = ntraced = 0;
+  if (n > 0 && !(events = malloc(n * sizeof(Event))))
+    return luaL_error(L, "out of memory");
+  return (nevents = n, 0);
+}
+
+/** spawn.tracedump() Lua function. */
+static int tracedump(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    return 2;
+  }
+  // Write the buffered events, oldest first, in Chrome's trace event format,
+  // with each process as a thread of a single "lspawn" process.
+  fputs("{\"traceEvents\":[\n", f);
+  fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+        "\"args\":{\"name\":\"lspawn\"}}", f);
+  size_t first = (ntraced > nevents) ? ntraced - nevents : 0;
+  for (size_t i = first; i < ntraced; i++) {
+    Event *e = &events[i % nevents];
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,"
+            "\"tid\":%d", e->name, e->phase, e->time * 1e6, e->pid);
+    if (e->phase == 'i') fputs(",\"s\":\"t\"", f);
+    if (e->arg) fprintf(f, ",\"args\":{\"value\":%ld}", e->arg);
+    fputc('}', f);
+  }
+  fputs("\n]}\n", f);
+  int ok = !ferror(f);
+  ok = (fclose(f) == 0) && ok;
+  if (!ok) {
+    lua_pushnil(L), lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    return 2;
+  }
+  ntraced = 0;
+  return (lua_pushboolean(L, 1), 1);
+}
+
+/** Calls `spawn()` when the module table is called. */
+static int spawn_call(lua_State *L) {
+  return (lua_remove(L, 1), spawn(L)); // remove module table
+}
+
+int luaopen_spawn(lua_State *L) {
 #if (!GTK || __APPLE__)
   // Need to keep track of running processes for monitoring fds and pids.
   lua_newtable(L), lua_setfield(L, LUA_REGISTRYINDEX, "spawn_procs");
+  const char *sv = getenv("LSPAWN_SERVER");
+  if (server < 0 && sv && *sv && strcmp(sv, "0") != 0) sv_start();
+#endif
+  // The module is a table of functions that can also be called like `spawn()`.
+  lua_newtable(L);
+  l_setcfunction(L, -1, "queue", queue);
+#if !_WIN32
+  l_setcfunction(L, -1, "command", command);
+#endif
+  l_setcfunction(L, -1, "stats", stats);
+  l_setcfunction(L, -1, "trace", trace);
+  l_setcfunction(L, -1, "tracedump", tracedump);
+  l_setcfunction(L, -1, "pipeline", pipeline);
+#if !_WIN32
+  l_setcfunction(L, -1, "run", run);
 #endif
-  return (lua_pushcfunction(L, spawn), 1);
+  lua_newtable(L), l_setcfunction(L, -1, "__call", spawn_call);
+  lua_setmetatable(L, -2);
+#if LUA_VERSION_NUM < 502
+  lua_pushvalue(L, -1), lua_setglobal(L, "spawn");
+#endif
+  return 1;
 }
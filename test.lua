@@ -0,0 +1,29 @@
+-- Copyright 2012-2016 Mitchell mitchell.att.foicica.com. See LICENSE.
+
+-- lspawn tests, run by lspawn_bench.
+-- Each test is an assertion; the first failure raises an error.
+
+local backend = ...
+
+-- spawn.run() returns output, the exit status, and whether its timeout passed.
+local stdout, stderr, status, timedout = spawn.run(
+  'sh -c "echo out; echo err >&2; exit 3"')
+assert(stdout == 'out\n' and stderr == 'err\n', 'run output')
+assert(status == 3 << 8, 'run exit status')
+assert(timedout == false, 'run without timeout')
+
+local start = now()
+stdout, stderr, status, timedout = spawn.run('sh -c "echo start; sleep 5"',
+  {timeout = 0.2})
+assert(timedout == true, 'run timeout not reported')
+assert(now() - start < 2, 'run timeout not enforced')
+assert(stdout == 'start\n', 'run partial output')
+
+stdout, stderr, status, timedout = spawn.run('sh -c "kill -9 $$"',
+  {timeout = 5})
+assert(status == 9 and timedout == false, 'run SIGKILL reported as timeout')
+
+stdout, stderr, status, timedout = spawn.run('cat', {input = 'x', timeout = 5})
+assert(stdout == 'x' and status == 0 and timedout == false, 'run input')
+
+print(string.format('{"test":"run","backend":"%s","result":"ok"}', backend))